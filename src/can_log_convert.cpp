@@ -0,0 +1,67 @@
+/*
+  can_log_convert.cpp: Converts binary CAN-Server log files
+    (--log-format binary) to the text log layout
+
+  (C) Copyright 2009 - 2022 by OSB connagtive GmbH
+
+  Use, modification and distribution are subject to the GNU General
+  Public License, see accompanying file LICENSE.txt
+*/
+
+#include "can_log_format.h"
+
+#include <iostream>
+#include <stdlib.h>
+
+#if defined(_MSC_VER)
+#pragma warning( disable : 4996 )
+#endif
+
+
+static void usage()
+{
+  std::cout
+    << "Usage: can_log_convert BINARY_LOG_FILE [TEXT_LOG_FILE]" << std::endl << std::endl
+    << "Converts a log file written by the CAN-Server with --log-format binary" << std::endl
+    << "to the text log layout. Without TEXT_LOG_FILE the text goes to stdout." << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  if ((argc < 2) || (argc > 3) || !strcmp(argv[1], "--help")) {
+    usage();
+    return 1;
+  }
+
+  FILE *f_in = fopen(argv[1], "rb");
+  if (!f_in) {
+    std::cerr << "Error: can not open " << argv[1] << "." << std::endl;
+    return 1;
+  }
+  FILE *f_out = (argc == 3) ? fopen(argv[2], "w") : stdout;
+  if (!f_out) {
+    std::cerr << "Error: can not open " << argv[2] << "." << std::endl;
+    return 1;
+  }
+
+  uint16_t ui16_version = 0;
+  canLogFrame_s s_frame;
+  bool b_error;
+  while (canLogReadBinary(f_in, ui16_version, s_frame, b_error))
+    canLogPrintText(f_out, s_frame.i64_time, s_frame.ui8_bus, s_frame.ui8_obj, s_frame.s_canMsg);
+
+  if (b_error) {
+    if (ui16_version == 0)
+      std::cerr << "Error: " << argv[1] << " is no binary CAN-Server log file." << std::endl;
+    else
+      std::cerr << "Error: unsupported log file version " << ui16_version << "." << std::endl;
+    return 1;
+  }
+  if (!feof(f_in))
+    std::cerr << "Warning: error reading " << argv[1] << "." << std::endl;
+
+  fclose(f_in);
+  if (f_out != stdout)
+    fclose(f_out);
+  return 0;
+}
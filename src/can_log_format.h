@@ -0,0 +1,145 @@
+/*
+  can_log_format.h: Layout of the CAN-Server log files, shared by the
+    server and the offline log converter
+
+  (C) Copyright 2009 - 2022 by OSB connagtive GmbH
+
+  Use, modification and distribution are subject to the GNU General
+  Public License, see accompanying file LICENSE.txt
+*/
+#ifndef CAN_LOG_FORMAT_H
+#define CAN_LOG_FORMAT_H
+
+#include <stdio.h>
+#include "can_server_interface.h"
+
+enum CanLogFormat_e {
+  CAN_LOG_FORMAT_TEXT,
+  CAN_LOG_FORMAT_BINARY
+};
+
+/* Binary log file: a header followed by fixed-size records, all in the byte
+ * order of the logging host (little endian on all supported platforms).
+ * Log files are appended to, so every time the server (re)opens a file a
+ * new header is written, which restarts the time base for the following
+ * records. A header takes the space of two records and starts with the
+ * magic, which is no valid start of a record (as time or identifier). */
+#define CAN_LOG_BINARY_MAGIC   "CANSRVLG"
+#define CAN_LOG_BINARY_VERSION 2
+
+#define CAN_LOG_FLAG_XTD 0x01
+
+struct canLogRecord_s {
+  int64_t  i64_time;       // server time [usec]
+  uint32_t ui32_id;
+  uint8_t  ui8_bus;
+  uint8_t  ui8_obj;
+  uint8_t  ui8_flags;      // CAN_LOG_FLAG_...
+  uint8_t  ui8_len;
+  uint8_t  arrui8_data[8];
+};
+
+struct canLogHeader_s {
+  char     arrc_magic[8];  // CAN_LOG_BINARY_MAGIC without '\0'
+  uint16_t ui16_version;
+  uint16_t ui16_recordSize;
+  int32_t  i32_fill;
+  int64_t  i64_startTime;  // server time [usec] when the file was opened
+  int64_t  i64_startTimeWallClock; // ... as [usec] since 1970-01-01 UTC
+  uint8_t  arrui8_reserved[16];
+};
+
+// version 1: time in [msec], header with 32 bit start time and wall clock in [msec]
+struct canLogRecordV1_s {
+  int32_t  i32_time;
+  uint32_t ui32_id;
+  uint8_t  ui8_bus;
+  uint8_t  ui8_obj;
+  uint8_t  ui8_flags;
+  uint8_t  ui8_len;
+  uint8_t  arrui8_data[8];
+};
+
+// frame as read from a log file
+struct canLogFrame_s {
+  int64_t  i64_time; // [usec]
+  uint8_t  ui8_bus;
+  uint8_t  ui8_obj;
+  canMsg_s s_canMsg;
+};
+
+/** Write a frame in the text log layout (time as [msec] with 3 decimals). */
+inline void canLogPrintText(FILE *f_handle, int64_t i64_time, uint8_t ui8_bus, uint8_t ui8_obj, const canMsg_s &ar_canMsg)
+{
+  fprintf(f_handle, "%10d.%03d %-2d %-2d %-2d %-2d %-2d %-8x  ",
+          int32_t(i64_time / 1000), int32_t(i64_time % 1000), ui8_bus, ui8_obj, ar_canMsg.i32_msgType, ar_canMsg.i32_len,
+          (ar_canMsg.ui32_id >> 26) & 7 /* priority */, ar_canMsg.ui32_id);
+  for (uint8_t ui8_i = 0; (ui8_i < ar_canMsg.i32_len) && (ui8_i < 8); ui8_i++)
+    fprintf(f_handle, " %-3hx", ar_canMsg.ui8_data[ui8_i]);
+  fprintf(f_handle, "\n");
+}
+
+/** Read the next frame of a binary log, headers are skipped.
+ *  aui16_version is the version of the last header, 0 before the first one.
+ *  \return false at the end of the file or on an invalid file (arb_error set)
+ */
+inline bool canLogReadBinary(FILE *f_handle, uint16_t &aui16_version, canLogFrame_s &ar_frame, bool &arb_error)
+{
+  // magic, version and record size
+  const size_t cn_prefix = 12;
+  uint8_t arrui8_buf[sizeof(canLogHeader_s)];
+
+  arb_error = false;
+  for (;;) {
+    if (fread(arrui8_buf, cn_prefix, 1, f_handle) != 1)
+      return false;
+
+    if (!memcmp(arrui8_buf, CAN_LOG_BINARY_MAGIC, 8)) {
+      uint16_t ui16_recordSize;
+      memcpy(&aui16_version, arrui8_buf + 8, sizeof(aui16_version));
+      memcpy(&ui16_recordSize, arrui8_buf + 10, sizeof(ui16_recordSize));
+      if (!(((aui16_version == 1) && (ui16_recordSize == sizeof(canLogRecordV1_s))) ||
+            ((aui16_version == CAN_LOG_BINARY_VERSION) && (ui16_recordSize == sizeof(canLogRecord_s))))) {
+        arb_error = true;
+        return false;
+      }
+      if (fread(arrui8_buf + cn_prefix, 2 * ui16_recordSize - cn_prefix, 1, f_handle) != 1)
+        return false;
+      continue;
+    }
+
+    if (aui16_version == 0) {
+      arb_error = true; // no header
+      return false;
+    }
+
+    if (aui16_version == 1) {
+      canLogRecordV1_s s_record;
+      memcpy(&s_record, arrui8_buf, cn_prefix);
+      if (fread(reinterpret_cast<uint8_t *>(&s_record) + cn_prefix, sizeof(s_record) - cn_prefix, 1, f_handle) != 1)
+        return false;
+      ar_frame.i64_time = int64_t(s_record.i32_time) * 1000;
+      ar_frame.s_canMsg.ui32_id = s_record.ui32_id;
+      ar_frame.ui8_bus = s_record.ui8_bus;
+      ar_frame.ui8_obj = s_record.ui8_obj;
+      ar_frame.s_canMsg.i32_msgType = (s_record.ui8_flags & CAN_LOG_FLAG_XTD) ? 1 : 0;
+      ar_frame.s_canMsg.i32_len = (s_record.ui8_len > 8) ? 8 : s_record.ui8_len;
+      memcpy(ar_frame.s_canMsg.ui8_data, s_record.arrui8_data, sizeof(ar_frame.s_canMsg.ui8_data));
+    } else {
+      canLogRecord_s s_record;
+      memcpy(&s_record, arrui8_buf, cn_prefix);
+      if (fread(reinterpret_cast<uint8_t *>(&s_record) + cn_prefix, sizeof(s_record) - cn_prefix, 1, f_handle) != 1)
+        return false;
+      ar_frame.i64_time = s_record.i64_time;
+      ar_frame.s_canMsg.ui32_id = s_record.ui32_id;
+      ar_frame.ui8_bus = s_record.ui8_bus;
+      ar_frame.ui8_obj = s_record.ui8_obj;
+      ar_frame.s_canMsg.i32_msgType = (s_record.ui8_flags & CAN_LOG_FLAG_XTD) ? 1 : 0;
+      ar_frame.s_canMsg.i32_len = (s_record.ui8_len > 8) ? 8 : s_record.ui8_len;
+      memcpy(ar_frame.s_canMsg.ui8_data, s_record.arrui8_data, sizeof(ar_frame.s_canMsg.ui8_data));
+    }
+    return true;
+  }
+}
+
+#endif
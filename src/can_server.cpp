@@ -19,8 +19,11 @@
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 #include "can_server_common.h"
 #include "can_filtering.h"
+#include "can_server_shm.h"
+#include "can_server_atomic.h"
 
 #ifdef WIN32
   #ifndef WINCE
@@ -30,6 +33,7 @@
   #include <fcntl.h>
   #include <sys/types.h>
   #include <sys/socket.h>
+  #include <sys/uio.h>
   #include <sys/un.h>
   #include <netinet/in.h>
   #include <arpa/inet.h>
@@ -41,6 +45,11 @@
   #include <stdio.h>
 #endif
 
+#ifdef CAN_SERVER_USE_EPOLL
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+#endif
+
 #ifndef WINCE
   #include <sys/stat.h>
 #endif
@@ -57,17 +66,36 @@
 __HAL::server_c::canBus_s::canBus_s() :
   mui16_globalMask(0),
   mi32_can_device(0),
+#ifdef CAN_SERVER_USE_EPOLL
+  mi32_can_deviceInEventLoop(-1),
+#endif
   mi32_sendDelay(0),
   mui16_busRefCnt(0),
-  m_logFile(LogFile_c::Null_s()())
+  m_logFile(LogFile_c::Null_s()()),
+  ms_routing(),
+  ms_stats(),
+  mui32_bitrate(0),
+  ms_load(),
+  ms_txQueue(),
+  mui16_tpSubscribers(0),
+  mmap_tpSessions()
 {
 }
 
 __HAL::server_c::server_c() :
   mb_logMode(false),
+  me_logFormat(CAN_LOG_FORMAT_TEXT),
+  ms_logQueue(),
+  mt_logWriter(),
+  mb_logWriterRunning(false),
+  mb_logWriterStop(false),
   mb_monitorMode(false),
+  mi64_monitorBusLoad(0),
   mb_inputFileMode(false),
   mf_canInput(0),
+  md_replaySpeed(1.0),
+  mb_replayLoop(false),
+  mb_replayStart(false),
 #ifdef DEFAULT_SUBSTITUTE_VIRTUAL
   mb_virtualSubstitute(true),
 #else
@@ -77,13 +105,45 @@ __HAL::server_c::server_c() :
   mb_daemon(false),
 #endif
   mi16_reducedLoadOnIsoBus(-1),
+  mn_clientTxQueueSize(256),
+  me_clientTxOverflow(TX_OVERFLOW_DROP_NEWEST),
+  mn_busTxQueueSize(256),
+  me_busTxOverflow(TX_OVERFLOW_DROP_NEWEST),
+  mb_txArbitration(false),
+  mui32_routeStamp(0),
+  mvec_routeReceivers(),
+  mui32_clientsToDisconnect(0),
+  mi32_txBatchLatency(0),
+  mvec_clientsToFlush(),
+  mi32_txBatchStart(0),
+  mi_metricsPort(0),
+  mlist_newClients(),
+  mvec_userMsgs(),
+  mvec_replayMsgs(),
+  mui32_requests(0),
+  mc_batchClock(),
+#ifdef CAN_SERVER_USE_SHM
+  mi32_nextShmId(0),
+#endif
+#ifdef CAN_SERVER_USE_EPOLL
+  mi_epollFd(-1),
+  mi_wakeUpFd(-1),
+  mmap_clientBySocket(),
+#endif
   mb_interactive(true),
   mi_canReadNiceValue(0),
-  mvec_canBus()
+  mvec_canBus(HAL_CAN_MAX_BUS_NR + 1)
 {
   memset(marrb_remoteDestinationAddressInUse, 0, sizeof(marrb_remoteDestinationAddressInUse));
-
-  pthread_mutex_init(&mt_protectClientList, NULL);
+  for (int i = 0; i < 0x100; ++i)
+    marrp_localAddressOwner[i] = NULL;
+  memset(marrui32_commandCount, 0, sizeof(marrui32_commandCount));
+  for (uint8_t ui8_bus = 0; ui8_bus < HAL_CAN_MAX_BUS_NR; ++ui8_bus)
+    marrui8_replayBusMap[ui8_bus] = ui8_bus;
+
+  pthread_mutex_init(&mt_protectHandOver, NULL);
+  pthread_mutex_init(&mt_protectLogFiles, NULL);
+  pthread_mutex_init(&mt_protectMetrics, NULL);
 }
 
 __HAL::client_c::canBus_s::canBus_s() :
@@ -93,13 +153,36 @@ __HAL::client_c::canBus_s::canBus_s() :
   mui32_globalMask(0),
   mui32_lastMask(0),
   mi32_sendDelay(0),
-  mb_initReceived(false)
+  mb_initReceived(false),
+  mvec_tpPgns()
+{
+}
+
+__HAL::client_c::txQueue_s::txQueue_s() :
+  mvec_ring(),
+  mn_head(0),
+  mn_count(0),
+  mn_headBytesSent(0),
+  mui32_dropped(0),
+  mb_waitWritable(false),
+  mvec_stamp()
 {
 }
 
 __HAL::client_c::client_c() :
+  ms_commandRx(),
+  ms_dataRx(),
+  ms_txQueue(),
+  mb_flushPending(false),
+  mb_disconnect(false),
+  mp_shm(NULL),
+  mi32_shmId(-1),
+  mui32_routeStamp(0),
+  mui8_routeObj(0),
   ui16_pid(0),
   i32_msecStartDeltaClientMinusServer(0),
+  mb_timeUsec(false),
+  ms_stats(),
   mvec_canBus()
 {
 }
@@ -164,6 +247,24 @@ int32_t getStartUpTime()
   { // returns time in msec
     return timeGetTime() - getStartUpTime();
   }
+
+  int64_t getTimeUsec()
+  { // returns time in usec, continues getTime() at its first call
+    static LARGE_INTEGER s_frequency;
+    static LARGE_INTEGER s_start;
+    static int64_t si64_startUsec = -1;
+    LARGE_INTEGER s_now;
+    QueryPerformanceCounter(&s_now);
+    if (si64_startUsec < 0)
+    {
+      QueryPerformanceFrequency(&s_frequency);
+      s_start = s_now;
+      si64_startUsec = int64_t(getTime()) * 1000;
+    }
+    const int64_t ci64_ticks = s_now.QuadPart - s_start.QuadPart;
+    return si64_startUsec + (ci64_ticks / s_frequency.QuadPart) * 1000000
+                          + (ci64_ticks % s_frequency.QuadPart) * 1000000 / s_frequency.QuadPart;
+  }
 #else
   // MinGW has neither simple access to timeGetTime()
   // nor to gettimeofday()
@@ -173,6 +274,11 @@ int32_t getStartUpTime()
   { // returns time in msec
     return (clock()/(CLOCKS_PER_SEC/1000));
   }
+
+  int64_t getTimeUsec()
+  {
+    return int64_t(getTime()) * 1000;
+  }
 #endif
 #else
   /** linux-begin */
@@ -220,6 +326,20 @@ int32_t getStartUpTime()
     return ci_now - getStartUpTime();
 #endif
   }
+
+  int64_t getTimeUsec()
+  {
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0))
+    return int64_t(getTime()) * 1000;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const int64_t ci64_now = int64_t(ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+    // same base as getTime(), but without its 32 bit wrap around
+    static const int64_t sci64_start = ci64_now - int64_t(getTime()) * 1000;
+    return ci64_now - sci64_start;
+#endif
+  }
   /** linux-end */
 #endif
 
@@ -238,15 +358,28 @@ void initClientTime( __HAL::client_c& ref_receiveClient, clock_t rt_startupClock
   DEBUG_PRINT1 ("Initialized ref_receiveClient.i32_msecStartDeltaClientMinusServer to %d\n", ref_receiveClient.i32_msecStartDeltaClientMinusServer);
 }
 
-int32_t getClientTime( __HAL::client_c& ref_receiveClient )
+// client time [msec] of a server time [usec]
+int32_t getClientTime( __HAL::client_c& ref_receiveClient, int64_t ai64_serverTime )
+{
+  return int32_t(ai64_serverTime / 1000) - ref_receiveClient.i32_msecStartDeltaClientMinusServer;
+}
+
+int64_t getClientTimeUsec( __HAL::client_c& ref_receiveClient, int64_t ai64_serverTime )
 {
-  return getTime() - ref_receiveClient.i32_msecStartDeltaClientMinusServer;
+  return ai64_serverTime - int64_t(ref_receiveClient.i32_msecStartDeltaClientMinusServer) * 1000;
 }
 
-//int32_t getServerTimeFromClientTime( __HAL::client_c& ref_receiveClient, int32_t ri32_clientTime )
-//{
-//  return ri32_clientTime + ref_receiveClient.i32_msecStartDeltaClientMinusServer;
-//}
+// server time [msec] of a client time [msec]
+int32_t getServerTimeFromClientTime( __HAL::client_c& ref_receiveClient, int32_t ri32_clientTime )
+{
+  return ri32_clientTime + ref_receiveClient.i32_msecStartDeltaClientMinusServer;
+}
+
+// server time [usec] of a client time [usec] (REGISTER_FLAG_TIME_USEC)
+int64_t getServerTimeUsecFromClientTime( __HAL::client_c& ref_receiveClient, int64_t ai64_clientTime )
+{
+  return ai64_clientTime + int64_t(ref_receiveClient.i32_msecStartDeltaClientMinusServer) * 1000;
+}
 
 } // end namespace
 
@@ -265,44 +398,27 @@ SOCKET_TYPE get_connection(SOCKET_TYPE listenSocket) {
   return(newSocket);
 }
 
-int read_data(SOCKET_TYPE s,     /* connected socket */
-              char *buf, /* pointer to the buffer */
-              int n      /* number of characters (bytes) we want */
-             )
+// hand the message over to the log writer thread
+void dumpCanMsg(__HAL::transferBuf_s *ap_transferBuf, __HAL::server_c *ap_server, int64_t ai64_time)
 {
-  int bcount; /* counts bytes read */
-  int br;     /* bytes read this pass */
-
-  bcount= 0;
-  br= 0;
-  while (bcount < n) {             /* loop until full buffer */
-    if ((br= recv(s,buf,n-bcount,0)) > 0) {
-      bcount += br;                /* increment byte counter */
-      buf += br;                   /* move buffer ptr for next read */
-    }
-    else if (br <= 0)               /* signal an error or end of communication (0) to the caller */
-      return br;
-  }
-  return(bcount);
-}
+  __HAL::logQueue_s &r_queue = ap_server->ms_logQueue;
+  const uint32_t cui32_head = r_queue.mui32_head;
 
-void dumpCanMsg(__HAL::transferBuf_s *ap_transferBuf, __HAL::server_c *ap_server)
-{
-  size_t n_bus = ap_transferBuf->s_data.ui8_bus;
-  if (!ap_server->canBus(n_bus).m_logFile) {
-    bool b_error = newFileLog( ap_server, n_bus );
-    if (b_error)
-      return;
+  if (cui32_head - __HAL::atomicLoadAcquire(&r_queue.mui32_tail) >= r_queue.mvec_ring.size())
+  { // writer can't keep up (or isn't started)
+    __HAL::atomicStoreRelease(&r_queue.mui32_dropped, r_queue.mui32_dropped + 1);
+    return;
   }
 
-  dumpCanMsg(
-      ap_transferBuf->s_data.ui8_bus,
-      ap_transferBuf->s_data.ui8_obj,
-      &ap_transferBuf->s_data.s_canMsg,
-      ap_server->canBus(n_bus).m_logFile->getRaw());
+  __HAL::logRecord_s &r_record = r_queue.mvec_ring[cui32_head % r_queue.mvec_ring.size()];
+  r_record.i64_time = ai64_time;
+  r_record.ui8_bus = ap_transferBuf->s_data.ui8_bus;
+  r_record.ui8_obj = ap_transferBuf->s_data.ui8_obj;
+  r_record.s_canMsg = ap_transferBuf->s_data.s_canMsg;
+  __HAL::atomicStoreRelease(&r_queue.mui32_head, cui32_head + 1);
 }
 
-void monitorCanMsg (__HAL::transferBuf_s *ps_transferBuf)
+void monitorCanMsg (__HAL::transferBuf_s *ps_transferBuf, int64_t ai64_time)
 {
   if( !can_filtering::pass(
         ps_transferBuf->s_data.ui8_bus,
@@ -311,16 +427,81 @@ void monitorCanMsg (__HAL::transferBuf_s *ps_transferBuf)
         ps_transferBuf->s_data.s_canMsg.ui8_data) )
    return;
 
-  printf("%10d %-2d %-2d %-2d %-2d %-2d %-8x  ",
-         __HAL::getTime(), ps_transferBuf->s_data.ui8_bus, ps_transferBuf->s_data.ui8_obj, ps_transferBuf->s_data.s_canMsg.i32_msgType, ps_transferBuf->s_data.s_canMsg.i32_len,
-         (ps_transferBuf->s_data.s_canMsg.ui32_id >> 26) & 7 /* priority */, ps_transferBuf->s_data.s_canMsg.ui32_id);
-  for (uint8_t ui8_i = 0; (ui8_i < ps_transferBuf->s_data.s_canMsg.i32_len) && (ui8_i < 8); ui8_i++)
-     printf(" %-3hx", ps_transferBuf->s_data.s_canMsg.ui8_data[ui8_i]);
-  printf("\n");
+  canLogPrintText(stdout, ai64_time, ps_transferBuf->s_data.ui8_bus, ps_transferBuf->s_data.ui8_obj, ps_transferBuf->s_data.s_canMsg);
   fflush(0);
 };
 
 
+// messages fetched from a CAN driver with one readFromBusBatch() call
+#define CAN_SERVER_READ_BATCH 32
+
+#ifdef CAN_SERVER_USE_EPOLL
+
+// epoll_event.data.u64 = (kind << 32) | socket or bus number
+#define EVENT_LOOP_KIND_CLIENT 0ULL
+#define EVENT_LOOP_KIND_BUS    1ULL
+#define EVENT_LOOP_KIND_WAKEUP 2ULL
+#define EVENT_LOOP_MAX_EVENTS  64
+
+static void addToEventLoop(__HAL::server_c* pc_serverData, int ai_fd, uint64_t aui64_kind, uint32_t aui32_key)
+{
+  struct epoll_event s_event;
+  memset(&s_event, 0, sizeof(s_event));
+  s_event.events = EPOLLIN;
+  s_event.data.u64 = (aui64_kind << 32) | aui32_key;
+  if (epoll_ctl(pc_serverData->mi_epollFd, EPOLL_CTL_ADD, ai_fd, &s_event) < 0)
+  {
+    if ((errno != EEXIST) || (epoll_ctl(pc_serverData->mi_epollFd, EPOLL_CTL_MOD, ai_fd, &s_event) < 0))
+      perror("epoll_ctl");
+  }
+}
+
+static void setEventLoopWritable(__HAL::server_c* pc_serverData, SOCKET_TYPE a_socket, bool ab_waitWritable)
+{
+  struct epoll_event s_event;
+  memset(&s_event, 0, sizeof(s_event));
+  s_event.events = ab_waitWritable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+  s_event.data.u64 = (EVENT_LOOP_KIND_CLIENT << 32) | uint32_t(a_socket);
+  if (epoll_ctl(pc_serverData->mi_epollFd, EPOLL_CTL_MOD, a_socket, &s_event) < 0)
+    perror("epoll_ctl");
+}
+
+static void removeFromEventLoop(__HAL::server_c* pc_serverData, int ai_fd)
+{
+  struct epoll_event s_event; // ignored, but must not be NULL for kernels < 2.6.9
+  (void)epoll_ctl(pc_serverData->mi_epollFd, EPOLL_CTL_DEL, ai_fd, &s_event);
+}
+
+static void addClientToEventLoop(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::iterator iter_client)
+{
+  pc_serverData->mmap_clientBySocket[iter_client->i32_commandSocket] = iter_client;
+  pc_serverData->mmap_clientBySocket[iter_client->i32_dataSocket] = iter_client;
+  addToEventLoop(pc_serverData, iter_client->i32_commandSocket, EVENT_LOOP_KIND_CLIENT, iter_client->i32_commandSocket);
+  addToEventLoop(pc_serverData, iter_client->i32_dataSocket, EVENT_LOOP_KIND_CLIENT, iter_client->i32_dataSocket);
+}
+
+static void removeClientFromEventLoop(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::iterator iter_client)
+{
+  removeFromEventLoop(pc_serverData, iter_client->i32_commandSocket);
+  removeFromEventLoop(pc_serverData, iter_client->i32_dataSocket);
+  pc_serverData->mmap_clientBySocket.erase(iter_client->i32_commandSocket);
+  pc_serverData->mmap_clientBySocket.erase(iter_client->i32_dataSocket);
+}
+
+#endif
+
+
+static void invalidateRoutingIndex(__HAL::server_c* pc_serverData, uint8_t ui8_bus)
+{
+  pc_serverData->canBus(ui8_bus).ms_routing.mb_valid = false;
+}
+
+static void invalidateRoutingIndices(__HAL::server_c* pc_serverData)
+{
+  for (size_t n_bus = 0; n_bus < pc_serverData->nCanBusses(); ++n_bus)
+    pc_serverData->canBus(n_bus).ms_routing.mb_valid = false;
+}
+
 void releaseClient(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::iterator& iter_delete)
 {
 #if DEBUG_CANSERVER
@@ -334,10 +515,61 @@ void releaseClient(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::i
       pc_serverData->canBus(ui8_cnt).mui16_busRefCnt--; // decrement bus ref count when client dropped off
 
       if (!pc_serverData->canBus(ui8_cnt).mui16_busRefCnt)
+      {
+        removeCanDeviceFromEventLoop(ui8_cnt, pc_serverData);
         closeBusOnCard(ui8_cnt, pc_serverData);
+      }
+    }
+  }
+
+#ifdef CAN_SERVER_USE_EPOLL
+  removeClientFromEventLoop(pc_serverData, iter_delete);
+#endif
+
+  // the routing indices refer to the client
+  invalidateRoutingIndices(pc_serverData);
+
+  // its addresses are free again
+  for (int i = 0; i < 0x100; ++i)
+  {
+    if (pc_serverData->marrp_localAddressOwner[i] == &*iter_delete)
+      pc_serverData->marrp_localAddressOwner[i] = NULL;
+  }
+
+  // its frames still waiting for the bus are sent without measuring the send delay
+  for (size_t n_bus = 0; n_bus < pc_serverData->nCanBusses(); ++n_bus)
+  {
+    std::vector<__HAL::busTxQueue_s::entry_s> &r_heap = pc_serverData->canBus(n_bus).ms_txQueue.mvec_heap;
+    for (size_t n = 0; n < r_heap.size(); ++n)
+    {
+      if (r_heap[n].p_client == &*iter_delete)
+        r_heap[n].p_client = NULL;
+    }
+  }
+
+  // its subscriptions end, transfers it started are reassembled without a sender
+  for (size_t n_bus = 0; n_bus < pc_serverData->nCanBusses(); ++n_bus)
+  {
+    __HAL::server_c::canBus_s &r_bus = pc_serverData->canBus(n_bus);
+    if ((n_bus < iter_delete->nCanBusses()) && !iter_delete->canBus(n_bus).mvec_tpPgns.empty() && !--r_bus.mui16_tpSubscribers)
+      r_bus.mmap_tpSessions.clear();
+    for (std::map< uint32_t, __HAL::tpSession_s >::iterator iter = r_bus.mmap_tpSessions.begin(); iter != r_bus.mmap_tpSessions.end(); ++iter)
+    {
+      if (iter->second.mp_sender == &*iter_delete)
+        iter->second.mp_sender = NULL;
     }
   }
 
+#ifdef CAN_SERVER_USE_SHM
+  __HAL::shmRelease(*iter_delete);
+#endif
+
+  if (iter_delete->mb_flushPending)
+  {
+    pc_serverData->mvec_clientsToFlush.erase(
+      std::find(pc_serverData->mvec_clientsToFlush.begin(), pc_serverData->mvec_clientsToFlush.end(), &*iter_delete));
+  }
+
   for (uint8_t k=0; k < iter_delete->nCanBusses(); k++)
     iter_delete->canBus(k).mvec_msgObj.clear();
 
@@ -370,94 +602,427 @@ void releaseClient(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::i
   iter_delete = pc_serverData->mlist_clients.erase(iter_delete);
 }
 
-static void enqueue_msg(__HAL::transferBuf_s* p_sockBuf, SOCKET_TYPE i32_socketSender, __HAL::server_c* pc_serverData)
+#ifdef WIN32
+  #define SOCKET_WOULD_BLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+  #define SOCKET_WOULD_BLOCK() ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+#endif
+
+// the first an_records of the TX queue are sent completely
+static void recordTxLatency(__HAL::server_c* pc_serverData, __HAL::client_c::txQueue_s& r_tx, size_t an_records)
 {
-  const uint8_t ui8_bus = p_sockBuf->s_data.ui8_bus;
+  const int64_t ci64_now = __HAL::getTimeUsec();
+  const size_t cn_capacity = r_tx.mvec_ring.size();
+  for (size_t n = 0; n < an_records; ++n)
+  {
+    const __HAL::client_c::txQueue_s::stamp_s &r_stamp = r_tx.mvec_stamp[(r_tx.mn_head + n) % cn_capacity];
+    if (!r_stamp.b_tpMessage)
+      pc_serverData->marrs_latency[r_stamp.ui8_latency].record(ci64_now - r_stamp.i64_rxTime);
+  }
+}
+
+/** Send as much of the client's TX queue as the data socket takes without blocking.
+ *  While something is left, readWrite() waits for the socket to become writable.
+ */
+static void flushClientTx(__HAL::server_c* pc_serverData, __HAL::client_c& r_client)
+{
+  __HAL::client_c::txQueue_s &r_tx = r_client.ms_txQueue;
+  const size_t cn_capacity = r_tx.mvec_ring.size();
+
+  while (r_tx.mn_count > 0)
+  {
+    // the queued records are at most two contiguous pieces of the ring
+    const size_t cn_firstRecords = (std::min)(r_tx.mn_count, cn_capacity - r_tx.mn_head);
+    char *const cp_first = (char*)&r_tx.mvec_ring[r_tx.mn_head] + r_tx.mn_headBytesSent;
+    const size_t cn_firstBytes = cn_firstRecords * sizeof(__HAL::transferBuf_s) - r_tx.mn_headBytesSent;
+    const size_t cn_secondBytes = (r_tx.mn_count - cn_firstRecords) * sizeof(__HAL::transferBuf_s);
+
+#ifdef WIN32
+    const size_t cn_wanted = cn_firstBytes; // second piece with next loop
+    const int ci_sent = send(r_client.i32_dataSocket, cp_first, int(cn_firstBytes), 0);
+#else
+    const size_t cn_wanted = cn_firstBytes + cn_secondBytes;
+    struct iovec arr_iov[2];
+    arr_iov[0].iov_base = cp_first;
+    arr_iov[0].iov_len = cn_firstBytes;
+    arr_iov[1].iov_base = &r_tx.mvec_ring[0];
+    arr_iov[1].iov_len = cn_secondBytes;
+    struct msghdr s_msg;
+    memset(&s_msg, 0, sizeof(s_msg));
+    s_msg.msg_iov = arr_iov;
+    s_msg.msg_iovlen = (cn_secondBytes > 0) ? 2 : 1;
+    const ssize_t ci_sent = sendmsg(r_client.i32_dataSocket, &s_msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+#endif
+
+    if (ci_sent < 0)
+    {
+      if (!SOCKET_WOULD_BLOCK())
+      {
+        DEBUG_PRINT1("send error %d\n", errno);
+        ++r_client.ms_stats.mui32_sendErrors;
+        // connection will be closed in next read from socket
+        r_tx.mn_head = 0;
+        r_tx.mn_count = 0;
+        r_tx.mn_headBytesSent = 0;
+      }
+      break;
+    }
+
+    const size_t cn_bytes = r_tx.mn_headBytesSent + size_t(ci_sent);
+    const size_t cn_records = cn_bytes / sizeof(__HAL::transferBuf_s);
+    if (cn_records > 0)
+      recordTxLatency(pc_serverData, r_tx, cn_records);
+    r_tx.mn_head = (r_tx.mn_head + cn_records) % cn_capacity;
+    r_tx.mn_count -= cn_records;
+    r_tx.mn_headBytesSent = cn_bytes % sizeof(__HAL::transferBuf_s);
+
+    if (size_t(ci_sent) < cn_wanted)
+      break; // socket buffer is full
+  }
+
+  const bool cb_waitWritable = (r_tx.mn_count > 0);
+  if (cb_waitWritable != r_tx.mb_waitWritable)
+  {
+    r_tx.mb_waitWritable = cb_waitWritable;
+#ifdef CAN_SERVER_USE_EPOLL
+    setEventLoopWritable(pc_serverData, r_client.i32_dataSocket, cb_waitWritable);
+#else
+    (void)pc_serverData;
+#endif
+  }
+}
+
+static void disconnectOnOverflow(__HAL::server_c* pc_serverData, __HAL::client_c& r_client)
+{
+  if (pc_serverData->mb_interactive)
+    printf("TX queue overflow, disconnecting client.\n");
+  r_client.mb_disconnect = true;
+  ++pc_serverData->mui32_clientsToDisconnect;
+}
+
+/** Send what was appended to the client's TX queue now, or with the batch of this pass.
+ */
+static void scheduleClientTx(__HAL::server_c* pc_serverData, __HAL::client_c& r_client)
+{
+  // if already waiting for the socket to become writable, the message has to wait behind the others
+  if (r_client.ms_txQueue.mb_waitWritable)
+    return;
+
+  if (pc_serverData->mi32_txBatchLatency <= 0)
+  {
+    flushClientTx(pc_serverData, r_client);
+    return;
+  }
+
+  // batching: sent by flushPendingClients() at the end of the pass or when the batch got too old
+  if (!r_client.mb_flushPending)
+  {
+    r_client.mb_flushPending = true;
+    if (pc_serverData->mvec_clientsToFlush.empty())
+      pc_serverData->mi32_txBatchStart = pc_serverData->mc_batchClock.nowMsec();
+    pc_serverData->mvec_clientsToFlush.push_back(&r_client);
+  }
+
+  if (pc_serverData->mc_batchClock.nowMsec() - pc_serverData->mi32_txBatchStart >= pc_serverData->mi32_txBatchLatency)
+    flushPendingClients(pc_serverData);
+}
+
+/** Append a message to the client's TX queue and send it right away if nothing is pending.
+ */
+static void queueToClient(__HAL::server_c* pc_serverData, __HAL::client_c& r_client, const __HAL::transferBuf_s& ar_transferBuf, int64_t ai64_rxTime, __HAL::latency_e ae_latency)
+{
+  __HAL::client_c::txQueue_s &r_tx = r_client.ms_txQueue;
+  const size_t cn_capacity = r_tx.mvec_ring.size();
+
+  if (r_client.mb_disconnect)
+    return;
+
+#ifdef CAN_SERVER_USE_SHM
+  if (r_client.mp_shm != NULL)
+  {
+    if (!__HAL::shmPushToClient(r_client, ar_transferBuf))
+    {
+      // the client owns the read index, so "drop-oldest" drops the newest message, too
+      ++r_tx.mui32_dropped;
+      if (pc_serverData->me_clientTxOverflow == __HAL::TX_OVERFLOW_DISCONNECT)
+        disconnectOnOverflow(pc_serverData, r_client);
+    }
+    else
+    {
+      ++r_client.ms_stats.mui32_delivered;
+      pc_serverData->marrs_latency[ae_latency].record(__HAL::getTimeUsec() - ai64_rxTime);
+    }
+    return;
+  }
+#endif
+
+  if (r_tx.mn_count == cn_capacity)
+  {
+    ++r_tx.mui32_dropped;
+    switch (pc_serverData->me_clientTxOverflow)
+    {
+      case __HAL::TX_OVERFLOW_DROP_NEWEST:
+        return;
+
+      case __HAL::TX_OVERFLOW_DROP_OLDEST:
+        if (r_tx.mvec_stamp[r_tx.mn_head].b_tpMessage)
+          return; // a reassembled message is dropped as a whole only => drop the newest
+        if (r_tx.mn_headBytesSent > 0)
+        { // head is partially sent and has to stay => drop the next one by moving the head onto it
+          const size_t cn_next = (r_tx.mn_head + 1) % cn_capacity;
+          if (r_tx.mvec_stamp[cn_next].b_tpMessage)
+            return; // ... unless that's part of a reassembled message
+          r_tx.mvec_ring[cn_next] = r_tx.mvec_ring[r_tx.mn_head];
+          r_tx.mvec_stamp[cn_next] = r_tx.mvec_stamp[r_tx.mn_head];
+          r_tx.mn_head = cn_next;
+        }
+        else
+          r_tx.mn_head = (r_tx.mn_head + 1) % cn_capacity;
+        --r_tx.mn_count;
+        break;
+
+      case __HAL::TX_OVERFLOW_DISCONNECT:
+        disconnectOnOverflow(pc_serverData, r_client);
+        return;
+    }
+  }
+
+  const size_t cn_tail = (r_tx.mn_head + r_tx.mn_count) % cn_capacity;
+  r_tx.mvec_ring[cn_tail] = ar_transferBuf;
+  r_tx.mvec_stamp[cn_tail].i64_rxTime = ai64_rxTime;
+  r_tx.mvec_stamp[cn_tail].ui8_latency = uint8_t(ae_latency);
+  r_tx.mvec_stamp[cn_tail].b_tpMessage = false;
+  ++r_tx.mn_count;
+  ++r_client.ms_stats.mui32_delivered;
+
+  scheduleClientTx(pc_serverData, r_client);
+}
+
+// enlarge the client's TX queue, the queued records move to the front
+static void growClientTx(__HAL::client_c::txQueue_s& r_tx, size_t an_capacity)
+{
+  const size_t cn_capacity = r_tx.mvec_ring.size();
+  std::vector<__HAL::transferBuf_s> vec_ring(an_capacity);
+  std::vector<__HAL::client_c::txQueue_s::stamp_s> vec_stamp(an_capacity);
+  for (size_t n = 0; n < r_tx.mn_count; ++n)
+  {
+    vec_ring[n] = r_tx.mvec_ring[(r_tx.mn_head + n) % cn_capacity];
+    vec_stamp[n] = r_tx.mvec_stamp[(r_tx.mn_head + n) % cn_capacity];
+  }
+  r_tx.mvec_ring.swap(vec_ring);
+  r_tx.mvec_stamp.swap(vec_stamp);
+  r_tx.mn_head = 0;
+}
+
+/** Append a reassembled transport protocol message (COMMAND_TP_DATA record and payload)
+ *  to the client's TX queue as a whole. A message larger than the queue grows it.
+ *  Without room it's dropped, also with "drop-oldest".
+ */
+static void queueTpToClient(__HAL::server_c* pc_serverData, __HAL::client_c& r_client, const __HAL::transferBuf_s& ar_header, const std::vector<uint8_t>& arvec_data, int64_t ai64_rxTime)
+{
+  __HAL::client_c::txQueue_s &r_tx = r_client.ms_txQueue;
+  const size_t cn_payloadRecords = (arvec_data.size() + sizeof(__HAL::transferBuf_s) - 1) / sizeof(__HAL::transferBuf_s);
+
+  if (r_client.mb_disconnect)
+    return;
+
+  if (1 + cn_payloadRecords > r_tx.mvec_ring.size())
+    growClientTx(r_tx, 1 + cn_payloadRecords);
+
+  const size_t cn_capacity = r_tx.mvec_ring.size();
+  if (r_tx.mn_count + 1 + cn_payloadRecords > cn_capacity)
+  {
+    ++r_tx.mui32_dropped;
+    if (pc_serverData->me_clientTxOverflow == __HAL::TX_OVERFLOW_DISCONNECT)
+      disconnectOnOverflow(pc_serverData, r_client);
+    return;
+  }
+
+  for (size_t n = 0; n <= cn_payloadRecords; ++n)
+  {
+    const size_t cn_tail = (r_tx.mn_head + r_tx.mn_count) % cn_capacity;
+    if (n == 0)
+      r_tx.mvec_ring[cn_tail] = ar_header;
+    else
+    {
+      const size_t cn_offset = (n - 1) * sizeof(__HAL::transferBuf_s);
+      r_tx.mvec_ring[cn_tail] = __HAL::transferBuf_s();
+      memcpy(&r_tx.mvec_ring[cn_tail], &arvec_data[cn_offset], (std::min)(sizeof(__HAL::transferBuf_s), arvec_data.size() - cn_offset));
+    }
+    r_tx.mvec_stamp[cn_tail].i64_rxTime = ai64_rxTime;
+    r_tx.mvec_stamp[cn_tail].ui8_latency = __HAL::LATENCY_RX_TO_CLIENT;
+    r_tx.mvec_stamp[cn_tail].b_tpMessage = true;
+    ++r_tx.mn_count;
+  }
+  ++r_client.ms_stats.mui32_delivered;
+
+  scheduleClientTx(pc_serverData, r_client);
+}
+
+/** Send the messages batched for the clients during this readWrite() pass.
+ */
+void flushPendingClients(__HAL::server_c* pc_serverData)
+{
+  for (std::vector<__HAL::client_c*>::iterator iter = pc_serverData->mvec_clientsToFlush.begin(); iter != pc_serverData->mvec_clientsToFlush.end(); ++iter)
+  {
+    (*iter)->mb_flushPending = false;
+    if (!(*iter)->ms_txQueue.mb_waitWritable)
+      flushClientTx(pc_serverData, **iter);
+  }
+  pc_serverData->mvec_clientsToFlush.clear();
+}
+
+/** Release the clients which were marked for disconnection by queueToClient().
+ */
+static void releaseDisconnectedClients(__HAL::server_c* pc_serverData)
+{
+  if (!pc_serverData->mui32_clientsToDisconnect)
+    return;
 
-  // mutex to prevent client list modification already got in calling function
+  for (std::list<__HAL::client_c>::iterator iter_client = pc_serverData->mlist_clients.begin(); iter_client != pc_serverData->mlist_clients.end(); )
+  {
+    if (iter_client->mb_disconnect)
+      releaseClient(pc_serverData, iter_client);
+    else
+      ++iter_client;
+  }
+  pc_serverData->mui32_clientsToDisconnect = 0;
+}
+
+/** Collect the message objects of all clients which can receive on the bus
+ *  into its routing index, grouped by filter mask.
+ */
+static void buildRoutingIndex(__HAL::server_c* pc_serverData, uint8_t ui8_bus)
+{
+  __HAL::routingIndex_s &r_index = pc_serverData->canBus(ui8_bus).ms_routing;
+  r_index.mvec_groups.clear();
 
   for (std::list<__HAL::client_c>::iterator iter = pc_serverData->mlist_clients.begin(); iter != pc_serverData->mlist_clients.end(); iter++) {
 
     if (!iter->canBus(ui8_bus).mb_busUsed)
       continue;
 
-    // i32_clientID != 0 in forwarding mode during send, do not enqueue this message for sending client
-    if (i32_socketSender && (iter->i32_dataSocket == i32_socketSender))
-      continue;
-
-    // now search for MsgObj queue on this ui8_bus, where new message from ui8_bus maps
     // start with 1 since MsgObj with id 0 is anyway planned for sending
     const int32_t i32_maxObj = iter->canBus(ui8_bus).mvec_msgObj.size();
     for (int32_t i32_obj = 1; i32_obj < i32_maxObj; i32_obj++) {
+      const __HAL::tMsgObj &r_obj = iter->canBus(ui8_bus).mvec_msgObj[i32_obj];
 
-      if ( (iter->canBus(ui8_bus).mvec_msgObj[i32_obj].ui8_bMsgType != RX )
-        || (iter->canBus(ui8_bus).mvec_msgObj[i32_obj].ui16_size == 0     ) )
-      { // this MsgObj is no candidate for message receive
-        continue;
-      }
+      if ( (r_obj.ui8_bMsgType != RX ) || (r_obj.ui16_size == 0) )
+        continue; // this MsgObj is no candidate for message receive
 
-      if (!iter->canBus(ui8_bus).mvec_msgObj[i32_obj].b_canObjConfigured) {
+      if (!r_obj.b_canObjConfigured)
         continue;
-      }
 
-      if ( iter->canBus(ui8_bus).mvec_msgObj[i32_obj].b_canBufferLock ) {
+      if (r_obj.b_canBufferLock) {
         // don't even check this MsgObj as it shall not receive messages
         DEBUG_PRINT2("lock bus %d, obj %d\n", ui8_bus, i32_obj);
         continue;
       }
 
-      // compare received msg with filter
-      if (
-          ( (iter->canBus(ui8_bus).mvec_msgObj[i32_obj].ui8_bufXtd > 0)
-                && (p_sockBuf->s_data.s_canMsg.i32_msgType > 0)
-                && ( (p_sockBuf->s_data.s_canMsg.ui32_id & iter->canBus(ui8_bus).mvec_msgObj[i32_obj].ui32_mask_xtd) == (iter->canBus(ui8_bus).mvec_msgObj[i32_obj].ui32_filter & iter->canBus(ui8_bus).mvec_msgObj[i32_obj].ui32_mask_xtd) )
-              )
-              ||
-              ( (iter->canBus(ui8_bus).mvec_msgObj[i32_obj].ui8_bufXtd == 0)
-                && (p_sockBuf->s_data.s_canMsg.i32_msgType == 0)
-                && ( (p_sockBuf->s_data.s_canMsg.ui32_id & iter->canBus(ui8_bus).mvec_msgObj[i32_obj].ui16_mask_std) == (iter->canBus(ui8_bus).mvec_msgObj[i32_obj].ui32_filter & iter->canBus(ui8_bus).mvec_msgObj[i32_obj].ui16_mask_std) )
-              )
-        )
-        { // received msg fits actual filter
-          //DEBUG_PRINT("queueing message\n");
-          // update send time stamp in paket
-          p_sockBuf->s_data.i32_sendTimeStamp = getClientTime(*iter);
-
-          p_sockBuf->s_data.ui8_obj = i32_obj;
-
-          if (send(iter->i32_dataSocket, (char*)p_sockBuf, sizeof(__HAL::transferBuf_s),
-#ifdef WIN32
-              0
-#else
-              MSG_DONTWAIT | MSG_NOSIGNAL
-#endif
-             ) < 0)
-          {
-            perror("send");
-            if(EPIPE == errno)
-            {
-                DEBUG_PRINT("pipe error\n");
-                // connection will be closed in next read from socket
-            }                
-          }
+      const bool cb_xtd = (r_obj.ui8_bufXtd > 0);
+      const uint32_t cui32_mask = cb_xtd ? r_obj.ui32_mask_xtd : r_obj.ui16_mask_std;
 
-          // don't check following objects if message is already enqueued for this client
-          break;
+      std::vector< __HAL::routeMaskGroup_s >::iterator iter_group = r_index.mvec_groups.begin();
+      while ((iter_group != r_index.mvec_groups.end()) && ((iter_group->mb_xtd != cb_xtd) || (iter_group->mui32_mask != cui32_mask)))
+        ++iter_group;
+
+      if (iter_group == r_index.mvec_groups.end()) {
+        r_index.mvec_groups.push_back(__HAL::routeMaskGroup_s());
+        iter_group = r_index.mvec_groups.end() - 1;
+        iter_group->mb_xtd = cb_xtd;
+        iter_group->mui32_mask = cui32_mask;
+      }
+
+      __HAL::routeTarget_s s_target;
+      s_target.mp_client = &*iter;
+      s_target.mui8_obj = uint8_t(i32_obj);
+      iter_group->mmap_targets[r_obj.ui32_filter & cui32_mask].push_back(s_target);
+    }
+  }
+
+  r_index.mb_valid = true;
+}
+
+// time stamp of a message to the client, see transferBuf_s::s_data
+static void setClientTimeStamp(__HAL::client_c& r_client, int64_t ai64_rxTime, int32_t& ri32_stamp, uint16_t& rui16_stampHigh)
+{
+  if (r_client.mb_timeUsec) {
+    const int64_t ci64_time = getClientTimeUsec(r_client, ai64_rxTime);
+    ri32_stamp = int32_t(uint32_t(ci64_time));
+    rui16_stampHigh = uint16_t(uint64_t(ci64_time) >> 32);
+  } else {
+    ri32_stamp = getClientTime(r_client, ai64_rxTime);
+    rui16_stampHigh = 0;
+  }
+}
+
+// ai64_rxTime: server time [usec] when the message was received (from the bus or a client)
+static void enqueue_msg(__HAL::transferBuf_s* p_sockBuf, SOCKET_TYPE i32_socketSender, __HAL::server_c* pc_serverData, int64_t ai64_rxTime)
+{
+  const uint8_t ui8_bus = p_sockBuf->s_data.ui8_bus;
+
+  // only called by the readWrite() thread, which owns the client list
+
+  __HAL::routingIndex_s &r_index = pc_serverData->canBus(ui8_bus).ms_routing;
+  if (!r_index.mb_valid)
+    buildRoutingIndex(pc_serverData, ui8_bus);
+
+  const bool cb_xtd = (p_sockBuf->s_data.s_canMsg.i32_msgType > 0);
+  const uint32_t cui32_id = p_sockBuf->s_data.s_canMsg.ui32_id;
+
+  if (++pc_serverData->mui32_routeStamp == 0)
+    ++pc_serverData->mui32_routeStamp; // 0 is the initial stamp of the clients
+  const uint32_t cui32_stamp = pc_serverData->mui32_routeStamp;
+
+  // each client gets the message once, for the lowest matching message object
+  std::vector<__HAL::client_c*> &r_receivers = pc_serverData->mvec_routeReceivers;
+  r_receivers.clear();
+
+  for (std::vector< __HAL::routeMaskGroup_s >::const_iterator iter_group = r_index.mvec_groups.begin(); iter_group != r_index.mvec_groups.end(); ++iter_group) {
+
+    if (iter_group->mb_xtd != cb_xtd)
+      continue;
+
+    std::map< uint32_t, std::vector< __HAL::routeTarget_s > >::const_iterator iter_targets = iter_group->mmap_targets.find(cui32_id & iter_group->mui32_mask);
+    if (iter_targets == iter_group->mmap_targets.end())
+      continue;
+
+    for (std::vector< __HAL::routeTarget_s >::const_iterator iter = iter_targets->second.begin(); iter != iter_targets->second.end(); ++iter) {
+      __HAL::client_c *p_client = iter->mp_client;
+
+      // i32_clientID != 0 in forwarding mode during send, do not enqueue this message for sending client
+      if (i32_socketSender && (p_client->i32_dataSocket == i32_socketSender))
+        continue;
+
+      if (p_client->mui32_routeStamp != cui32_stamp) {
+        p_client->mui32_routeStamp = cui32_stamp;
+        p_client->mui8_routeObj = iter->mui8_obj;
+        r_receivers.push_back(p_client);
+      }
+      else if (iter->mui8_obj < p_client->mui8_routeObj)
+        p_client->mui8_routeObj = iter->mui8_obj;
+    }
+  }
 
-        } // if fit
-    } // for objNr
-  }// for iter
+  for (std::vector<__HAL::client_c*>::iterator iter = r_receivers.begin(); iter != r_receivers.end(); ++iter) {
+    // update send time stamp in paket
+    setClientTimeStamp(**iter, ai64_rxTime, p_sockBuf->s_data.i32_sendTimeStamp, p_sockBuf->s_data.ui16_sendTimeStampHigh);
 
+    p_sockBuf->s_data.ui8_obj = (*iter)->mui8_routeObj;
+
+    queueToClient(pc_serverData, **iter, *p_sockBuf, ai64_rxTime, i32_socketSender ? __HAL::LATENCY_CLIENT_TO_CLIENT : __HAL::LATENCY_RX_TO_CLIENT);
+  }
 }
 
 
-void send_command_ack(SOCKET_TYPE ri32_commandSocket, int32_t ri32_dataContent, int32_t ri32_data, __HAL::server_c &ar_server)
+void send_command_ack(SOCKET_TYPE ri32_commandSocket, int32_t ri32_dataContent, int32_t ri32_data, int32_t ri32_registerFlags, __HAL::server_c &ar_server)
 {
   __HAL::transferBuf_s s_transferBuf;
 
   s_transferBuf.ui16_command = COMMAND_ACKNOWLEDGE;
   s_transferBuf.s_acknowledge.i32_dataContent = ri32_dataContent;
   s_transferBuf.s_acknowledge.i32_data = ri32_data;
+  s_transferBuf.s_acknowledge.i32_registerFlags = ri32_registerFlags;
 
   if (send(ri32_commandSocket, (char*)&s_transferBuf, sizeof(__HAL::transferBuf_s),
 #ifdef WIN32
@@ -477,29 +1042,241 @@ void send_command_ack(SOCKET_TYPE ri32_commandSocket, int32_t ri32_dataContent,
 }
 
 
-/////////////////////////////////////////////////////////////////////////
-bool handleCommand(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::iterator& iter_client, __HAL::transferBuf_s* p_writeBuf)
+/** Look up the counter queried by COMMAND_STATS.
+ *  \return false for an unknown counter, bus or client
+ */
+static bool getStatsValue(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::iterator& iter_client, __HAL::transferBuf_s* p_writeBuf, int32_t& ri32_value)
 {
-  int32_t i32_error;
-  int32_t i32_dataContent;
-  int32_t i32_data=0;
-
-  DEBUG_PRINT1("cmd %d\n", p_writeBuf->ui16_command);
-
-  i32_error = 0;
-
-  // default to simple ACK which returns the error.
-  // Overwrite if special answers needed like PIPE_ID or SEND_DELAY
-  i32_dataContent = ACKNOWLEDGE_DATA_CONTENT_ERROR_VALUE;
-  // in DATA_CONTENT_ERROR_VALUE case i32_error will be used as i32_data!!!
+  const uint32_t cui32_counter = p_writeBuf->s_config.ui32_dwId;
+  const uint8_t cui8_bus = p_writeBuf->s_config.ui8_bus;
+  const uint8_t cui8_obj = p_writeBuf->s_config.ui8_obj;
 
-    switch (p_writeBuf->ui16_command)
+  if ((cui32_counter >= STATS_BUS_RX_FRAMES) && (cui32_counter <= STATS_BUS_TX_DROPPED))
+  {
+    if (cui8_bus >= pc_serverData->nCanBusses())
+      return false;
+    __HAL::server_c::canBus_s &r_bus = pc_serverData->canBus(cui8_bus);
+    const __HAL::busStats_s &r_stats = r_bus.ms_stats;
+    const int64_t ci64_now = pc_serverData->mc_batchClock.nowUsec();
+    switch (cui32_counter)
     {
+      case STATS_BUS_RX_FRAMES:  ri32_value = int32_t(r_stats.mui32_rxFrames); break;
+      case STATS_BUS_RX_BYTES:   ri32_value = int32_t(r_stats.mui32_rxBytes);  break;
+      case STATS_BUS_TX_FRAMES:  ri32_value = int32_t(r_stats.mui32_txFrames); break;
+      case STATS_BUS_TX_BYTES:   ri32_value = int32_t(r_stats.mui32_txBytes);  break;
+      case STATS_BUS_TX_ERRORS:  ri32_value = int32_t(r_stats.mui32_txErrors); break;
+      case STATS_BUS_LOAD_100MS: ri32_value = int32_t(r_bus.ms_load.load(ci64_now, __HAL::BUS_LOAD_100MS, r_bus.mui32_bitrate)); break;
+      case STATS_BUS_LOAD_1S:    ri32_value = int32_t(r_bus.ms_load.load(ci64_now, __HAL::BUS_LOAD_1S, r_bus.mui32_bitrate)); break;
+      case STATS_BUS_LOAD_10S:   ri32_value = int32_t(r_bus.ms_load.load(ci64_now, __HAL::BUS_LOAD_10S, r_bus.mui32_bitrate)); break;
+      case STATS_BUS_TX_QUEUED:  ri32_value = int32_t(r_bus.ms_txQueue.size()); break;
+      default:                   ri32_value = int32_t(r_stats.mui32_txDropped); break;
+    }
+    return true;
+  }
+
+  if ((cui32_counter >= STATS_CLIENT_RX_FRAMES) && (cui32_counter <= STATS_CLIENT_SEND_ERRORS))
+  {
+    std::list<__HAL::client_c>::iterator iter = iter_client;
+    if (cui8_obj != 0xFF)
+    {
+      iter = pc_serverData->mlist_clients.begin();
+      for (uint8_t ui8_index = 0; (iter != pc_serverData->mlist_clients.end()) && (ui8_index < cui8_obj); ++ui8_index)
+        ++iter;
+      if (iter == pc_serverData->mlist_clients.end())
+        return false;
+    }
+    switch (cui32_counter)
+    {
+      case STATS_CLIENT_RX_FRAMES:  ri32_value = int32_t(iter->ms_stats.mui32_rxFrames);   break;
+      case STATS_CLIENT_DELIVERED:  ri32_value = int32_t(iter->ms_stats.mui32_delivered);  break;
+      case STATS_CLIENT_DROPPED:    ri32_value = int32_t(iter->ms_txQueue.mui32_dropped);  break;
+      case STATS_CLIENT_QUEUED:     ri32_value = int32_t(iter->ms_txQueue.mn_count);       break;
+      default:                      ri32_value = int32_t(iter->ms_stats.mui32_sendErrors); break;
+    }
+    return true;
+  }
+
+  switch (cui32_counter)
+  {
+    case STATS_BUS_TP_MESSAGES:
+    case STATS_BUS_TP_ABORTED:
+      if (cui8_bus >= pc_serverData->nCanBusses())
+        return false;
+      ri32_value = int32_t((cui32_counter == STATS_BUS_TP_MESSAGES) ? pc_serverData->canBus(cui8_bus).ms_stats.mui32_tpMessages
+                                                                    : pc_serverData->canBus(cui8_bus).ms_stats.mui32_tpAborted);
+      return true;
+    case STATS_CLIENTS:
+      ri32_value = int32_t(pc_serverData->mlist_clients.size());
+      return true;
+    case STATS_LOG_DROPPED:
+      ri32_value = int32_t(pc_serverData->ms_logQueue.mui32_dropped);
+      return true;
+    case STATS_COMMANDS:
+      ri32_value = int32_t(pc_serverData->marrui32_commandCount[(cui8_obj < CAN_SERVER_STATS_COMMANDS) ? cui8_obj : 0]);
+      return true;
+    default:
+      return false;
+  }
+}
+
+const char* commandName(uint16_t ui16_command)
+{
+  switch (ui16_command)
+  {
+    case COMMAND_REGISTER:        return "REGISTER";
+    case COMMAND_DEREGISTER:      return "DEREGISTER";
+    case COMMAND_INIT:            return "INIT";
+    case COMMAND_CLOSE:           return "CLOSE";
+    case COMMAND_CHG_GLOBAL_MASK: return "CHG_GLOBAL_MASK";
+    case COMMAND_CONFIG:          return "CONFIG";
+    case COMMAND_CHG_CONFIG:      return "CHG_CONFIG";
+    case COMMAND_LOCK:            return "LOCK";
+    case COMMAND_UNLOCK:          return "UNLOCK";
+    case COMMAND_QUERYLOCK:       return "QUERYLOCK";
+    case COMMAND_CLOSEOBJ:        return "CLOSEOBJ";
+    case COMMAND_SEND_DELAY:      return "SEND_DELAY";
+    case COMMAND_STATS:           return "STATS";
+    case COMMAND_TP_SUBSCRIBE:    return "TP_SUBSCRIBE";
+    case COMMAND_TP_UNSUBSCRIBE:  return "TP_UNSUBSCRIBE";
+    default:                      return "unknown";
+  }
+}
+
+// bus load of the three windows in [%], prefixed with apc_prefix
+static void printBusLoad(__HAL::server_c* pc_serverData, size_t an_bus, const char* apc_prefix)
+{
+  __HAL::server_c::canBus_s &r_bus = pc_serverData->canBus(an_bus);
+  if (!r_bus.mui32_bitrate)
+    return;
+  const int64_t ci64_now = __HAL::getTimeUsec();
+  uint32_t arrui32_load[__HAL::BUS_LOAD_WINDOWS];
+  for (int i = 0; i < __HAL::BUS_LOAD_WINDOWS; ++i)
+    arrui32_load[i] = r_bus.ms_load.load(ci64_now, __HAL::busLoadWindow_e(i), r_bus.mui32_bitrate);
+  printf("%s %u.%02u%% (100 ms) %u.%02u%% (1 s) %u.%02u%% (10 s) at %u kbit/s\n", apc_prefix,
+         arrui32_load[0] / 100, arrui32_load[0] % 100, arrui32_load[1] / 100, arrui32_load[1] % 100,
+         arrui32_load[2] / 100, arrui32_load[2] % 100, r_bus.mui32_bitrate);
+}
+
+/** Show the bus load of the open busses once per second in monitor mode.
+ */
+static void monitorBusLoad(__HAL::server_c* pc_serverData)
+{
+  if (!pc_serverData->mb_monitorMode)
+    return;
+  const int64_t ci64_now = __HAL::getTimeUsec();
+  if (ci64_now - pc_serverData->mi64_monitorBusLoad < 1000000)
+    return;
+  pc_serverData->mi64_monitorBusLoad = ci64_now;
+
+  for (size_t n_bus = 0; n_bus < pc_serverData->nCanBusses(); ++n_bus)
+  {
+    if (pc_serverData->canBus(n_bus).mui16_busRefCnt)
+    {
+      char arrc_prefix[32];
+      sprintf(arrc_prefix, "# bus %d load", int(n_bus));
+      printBusLoad(pc_serverData, n_bus, arrc_prefix);
+    }
+  }
+  fflush(stdout);
+}
+
+/** Print the statistics requested with the interactive "stats" command.
+ */
+static void printStats(__HAL::server_c* pc_serverData)
+{
+  printf("Busses:\n");
+  for (size_t n_bus = 0; n_bus < pc_serverData->nCanBusses(); ++n_bus)
+  {
+    const __HAL::busStats_s &r_stats = pc_serverData->canBus(n_bus).ms_stats;
+    if (!pc_serverData->canBus(n_bus).mui16_busRefCnt && !r_stats.mui32_rxFrames && !r_stats.mui32_txFrames && !r_stats.mui32_txErrors)
+      continue;
+    printf("  %-2d rx %u frames %u bytes, tx %u frames %u bytes, tx errors %u\n", int(n_bus),
+           r_stats.mui32_rxFrames, r_stats.mui32_rxBytes, r_stats.mui32_txFrames, r_stats.mui32_txBytes, r_stats.mui32_txErrors);
+    if (r_stats.mui32_txLocal)
+      printf("     not sent as local %u\n", r_stats.mui32_txLocal);
+    if (r_stats.mui32_tpMessages || r_stats.mui32_tpAborted)
+      printf("     transport protocol messages %u, aborted %u\n", r_stats.mui32_tpMessages, r_stats.mui32_tpAborted);
+    if (pc_serverData->canBus(n_bus).ms_txQueue.size() || r_stats.mui32_txDropped)
+      printf("     tx queued %u, dropped %u\n", unsigned(pc_serverData->canBus(n_bus).ms_txQueue.size()), r_stats.mui32_txDropped);
+    printBusLoad(pc_serverData, n_bus, "     load");
+  }
+
+  printf("Clients:\n");
+  int i_index = 0;
+  for (std::list<__HAL::client_c>::iterator iter = pc_serverData->mlist_clients.begin(); iter != pc_serverData->mlist_clients.end(); ++iter, ++i_index)
+  {
+    printf("  %-2d %s rx %u frames, delivered %u, dropped %u, queued %u, send errors %u\n", i_index,
+           (iter->mp_shm != NULL) ? "shm   " : "socket",
+           iter->ms_stats.mui32_rxFrames, iter->ms_stats.mui32_delivered, iter->ms_txQueue.mui32_dropped,
+           unsigned(iter->ms_txQueue.mn_count), iter->ms_stats.mui32_sendErrors);
+  }
+
+  printf("Commands:\n");
+  for (uint16_t ui16_command = 0; ui16_command < CAN_SERVER_STATS_COMMANDS; ++ui16_command)
+  {
+    if (pc_serverData->marrui32_commandCount[ui16_command])
+      printf("  %-16s %u\n", commandName(ui16_command), pc_serverData->marrui32_commandCount[ui16_command]);
+  }
+
+  if (pc_serverData->ms_logQueue.mui32_dropped)
+    printf("Log: %u frames dropped\n", pc_serverData->ms_logQueue.mui32_dropped);
+  fflush(stdout);
+}
+
+
+/** Change the client's subscription to reassembled messages on a bus
+ *  (TP_PGN_ALL unsubscribes from all).
+ */
+static void changeTpSubscription(__HAL::server_c* pc_serverData, __HAL::client_c& r_client, uint8_t aui8_bus, uint32_t aui32_pgn, bool ab_subscribe)
+{
+  __HAL::server_c::canBus_s &r_bus = pc_serverData->canBus(aui8_bus);
+  std::vector<uint32_t> &r_pgns = r_client.canBus(aui8_bus).mvec_tpPgns;
+  const bool cb_wasSubscribed = !r_pgns.empty();
+
+  std::vector<uint32_t>::iterator iter = std::find(r_pgns.begin(), r_pgns.end(), aui32_pgn);
+  if (ab_subscribe)
+  {
+    if (iter == r_pgns.end())
+      r_pgns.push_back(aui32_pgn);
+  }
+  else if (aui32_pgn == TP_PGN_ALL)
+    r_pgns.clear();
+  else if (iter != r_pgns.end())
+    r_pgns.erase(iter);
+
+  if (!cb_wasSubscribed && !r_pgns.empty())
+    ++r_bus.mui16_tpSubscribers;
+  else if (cb_wasSubscribed && r_pgns.empty() && !--r_bus.mui16_tpSubscribers)
+    r_bus.mmap_tpSessions.clear();
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+bool handleCommand(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::iterator& iter_client, __HAL::transferBuf_s* p_writeBuf)
+{
+  int32_t i32_error;
+  int32_t i32_dataContent;
+  int32_t i32_data=0;
+  int32_t i32_registerFlags=0;
+
+  DEBUG_PRINT1("cmd %d\n", p_writeBuf->ui16_command);
+
+  ++pc_serverData->marrui32_commandCount[(p_writeBuf->ui16_command < CAN_SERVER_STATS_COMMANDS) ? p_writeBuf->ui16_command : 0];
+
+  i32_error = 0;
+
+  // default to simple ACK which returns the error.
+  // Overwrite if special answers needed like PIPE_ID or SEND_DELAY
+  i32_dataContent = ACKNOWLEDGE_DATA_CONTENT_ERROR_VALUE;
+  // in DATA_CONTENT_ERROR_VALUE case i32_error will be used as i32_data!!!
+
+    switch (p_writeBuf->ui16_command)
+    {
+
+      case COMMAND_REGISTER:
+      {
+        DEBUG_PRINT("COMMAND_REGISTER\n");
 
-      case COMMAND_REGISTER:
-      {
-        DEBUG_PRINT("COMMAND_REGISTER\n");
-
         // no need to set to 0, as everything got set to zero before!
         // s_tmpClient.canBus(all-buses).mi32_sendDelay = 0;
 
@@ -512,6 +1289,18 @@ bool handleCommand(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::i
         { // no error
           // transmit current pipeId to client (for composition of pipe name)
           i32_dataContent = ACKNOWLEDGE_DATA_CONTENT_PIPE_ID;
+#ifdef CAN_SERVER_USE_SHM
+          if ((p_writeBuf->s_startTimeClock.i32_fill1 & REGISTER_FLAG_SHARED_MEMORY)
+              && ((iter_client->mp_shm != NULL) || __HAL::shmCreate(*pc_serverData, *iter_client)))
+          {
+            i32_dataContent = ACKNOWLEDGE_DATA_CONTENT_SHM_ID;
+            i32_data = iter_client->mi32_shmId;
+            i32_registerFlags |= REGISTER_FLAG_SHARED_MEMORY;
+          }
+#endif
+          iter_client->mb_timeUsec = (p_writeBuf->s_startTimeClock.i32_fill1 & REGISTER_FLAG_TIME_USEC) != 0;
+          if (iter_client->mb_timeUsec)
+            i32_registerFlags |= REGISTER_FLAG_TIME_USEC;
         }
       }
       break;
@@ -536,22 +1325,14 @@ bool handleCommand(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::i
           i32_error = HAL_RANGE_ERR;
         else if (!pc_serverData->canBus(p_writeBuf->s_init.ui8_bus).mui16_busRefCnt)
         { // first init command for current bus
-          // open log file only once per bus
-          if (pc_serverData->mb_logMode) {
-            newFileLog( pc_serverData, p_writeBuf->s_init.ui8_bus);
-          }
-
-          if (!openBusOnCard(p_writeBuf->s_init.ui8_bus,  // 0 for CANLPT/ICAN, else 1 for first BUS
-                             p_writeBuf->s_init.ui16_wBitrate,  // BTR0BTR1
-                             pc_serverData))
-          {
-            std::cerr << "Can't initialize CAN-BUS." << std::endl;
-            std::cerr << "CAN device/driver not ready.\n" << std::endl;
-            i32_error = HAL_CONFIG_ERR;
-            exit(1);
-          }
+          openBus(p_writeBuf->s_init.ui8_bus, p_writeBuf->s_init.ui16_wBitrate, pc_serverData);
+          // a bus without device handle changes the wait condition
+          wakeUpReadWrite(pc_serverData);
         }
 
+        if (pc_serverData->mb_inputFileMode)
+          pc_serverData->mb_replayStart = true;
+
         if (!i32_error) {
           pc_serverData->canBus(p_writeBuf->s_init.ui8_bus).mui16_busRefCnt++;
           iter_client->canBus(p_writeBuf->s_init.ui8_bus).mb_initReceived = true; // when the CLOSE command is received => allow decrement of ref count
@@ -583,6 +1364,7 @@ bool handleCommand(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::i
           if (pc_serverData->canBus(p_writeBuf->s_init.ui8_bus).mui16_busRefCnt == 0)
           {
             // close can device
+            removeCanDeviceFromEventLoop(p_writeBuf->s_init.ui8_bus, pc_serverData);
             closeBusOnCard(p_writeBuf->s_init.ui8_bus, pc_serverData);
           }
 
@@ -698,23 +1480,882 @@ bool handleCommand(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::i
         }
         break;
 
+      case COMMAND_TP_SUBSCRIBE:
+      case COMMAND_TP_UNSUBSCRIBE:
+        if ((p_writeBuf->s_config.ui8_bus > HAL_CAN_MAX_BUS_NR) ||
+            ((p_writeBuf->s_config.ui32_dwId > 0x3FFFF) && (p_writeBuf->s_config.ui32_dwId != TP_PGN_ALL)))
+          i32_error = HAL_RANGE_ERR;
+        else
+          changeTpSubscription(pc_serverData, *iter_client, p_writeBuf->s_config.ui8_bus, p_writeBuf->s_config.ui32_dwId,
+                               p_writeBuf->ui16_command == COMMAND_TP_SUBSCRIBE);
+        break;
+
+      case COMMAND_STATS:
+        if (getStatsValue(pc_serverData, iter_client, p_writeBuf, i32_data))
+          i32_dataContent = ACKNOWLEDGE_DATA_CONTENT_STATS;
+        else
+          i32_error = HAL_RANGE_ERR;
+        break;
+
       default:
         i32_error = HAL_UNKNOWN_ERR;
         break;
     } // end switch
 
+    if (!i32_error)
+    {
+      switch (p_writeBuf->ui16_command)
+      {
+        case COMMAND_INIT:
+        case COMMAND_CLOSE:
+        case COMMAND_CONFIG:
+        case COMMAND_CHG_CONFIG:
+        case COMMAND_LOCK:
+        case COMMAND_UNLOCK:
+        case COMMAND_CLOSEOBJ:
+          // receive configuration of the bus changed
+          invalidateRoutingIndex(pc_serverData, p_writeBuf->s_config.ui8_bus);
+          break;
+      }
+    }
+
     // do centralized error-answering here
     if (i32_dataContent == ACKNOWLEDGE_DATA_CONTENT_ERROR_VALUE) i32_data = i32_error;
 
-    send_command_ack(iter_client->i32_commandSocket, i32_dataContent, i32_data, *pc_serverData);
+    send_command_ack(iter_client->i32_commandSocket, i32_dataContent, i32_data, i32_registerFlags, *pc_serverData);
     return false; // client not released, we did even send the ACK :)
 }
 
 
+// ISOBUS identifier fields (ISO 11783-3)
+#define ISO_SA(id)       ((id) & 0xFF)
+#define ISO_PS(id)       (((id) >> 8) & 0xFF)
+#define ISO_PF(id)       (((id) >> 16) & 0xFF)
+#define ISO_DP_PF(id)    (((id) >> 16) & 0x3FF)
+#define ISO_PGN_ADDRESS_CLAIM_DP_PF 0x0EE
+#define ISO_ADDRESS_NULL   0xFE
+#define ISO_ADDRESS_GLOBAL 0xFF
+
+// source address of an address claim on the bus of --reduced-load-iso-bus-no, else -1
+static int isoClaimedAddress(__HAL::server_c* pc_serverData, uint8_t aui8_bus, const canMsg_s& ar_canMsg)
+{
+  if ((pc_serverData->mi16_reducedLoadOnIsoBus != aui8_bus) || !ar_canMsg.i32_msgType ||
+      (ISO_DP_PF(ar_canMsg.ui32_id) != ISO_PGN_ADDRESS_CLAIM_DP_PF) || (ISO_SA(ar_canMsg.ui32_id) == ISO_ADDRESS_NULL))
+    return -1;
+  return int(ISO_SA(ar_canMsg.ui32_id));
+}
+
+/** With --reduced-load-iso-bus-no: learn the addresses claimed by the clients
+ *  and tell whether a frame is destined to one of them only.
+ */
+static bool isIsoLocalTraffic(__HAL::server_c* pc_serverData, uint8_t aui8_bus, const canMsg_s& ar_canMsg, __HAL::client_c* ap_client)
+{
+  if (pc_serverData->mi16_reducedLoadOnIsoBus != aui8_bus)
+    return false;
+
+  const int ci_claimed = isoClaimedAddress(pc_serverData, aui8_bus, ar_canMsg);
+  if ((ci_claimed >= 0) && (ap_client != NULL))
+    pc_serverData->marrp_localAddressOwner[ci_claimed] = ap_client;
+
+  // PDU1 (destination specific) to a client's address that isn't used on the bus
+  const uint32_t cui32_id = ar_canMsg.ui32_id;
+  if (!ar_canMsg.i32_msgType || (ISO_PF(cui32_id) >= 0xF0) || (ISO_PS(cui32_id) == ISO_ADDRESS_GLOBAL))
+    return false;
+  return (pc_serverData->marrp_localAddressOwner[ISO_PS(cui32_id)] != NULL) &&
+         !pc_serverData->marrb_remoteDestinationAddressInUse[ISO_PS(cui32_id)];
+}
+
+// ISOBUS transport protocol (ISO 11783-3): connection management and data transfer
+#define ISO_PGN_TP_CM_DP_PF  0x0EC
+#define ISO_PGN_TP_DT_DP_PF  0x0EB
+#define ISO_PGN_ETP_CM_DP_PF 0x0C8
+#define ISO_PGN_ETP_DT_DP_PF 0x0C7
+#define ISO_TP_RTS    16
+#define ISO_TP_EOMA   19
+#define ISO_ETP_RTS   20
+#define ISO_ETP_DPO   22
+#define ISO_ETP_EOMA  23
+#define ISO_TP_BAM    32
+#define ISO_TP_ABORT  255
+#define ISO_TP_MAX_SIZE 1785
+
+// drop the sessions of the bus without a frame for CAN_SERVER_TP_TIMEOUT
+static void expireTpSessions(__HAL::server_c::canBus_s& r_bus, int64_t ai64_now)
+{
+  for (std::map< uint32_t, __HAL::tpSession_s >::iterator iter = r_bus.mmap_tpSessions.begin(); iter != r_bus.mmap_tpSessions.end(); )
+  {
+    if (ai64_now - iter->second.mi64_lastFrame > int64_t(CAN_SERVER_TP_TIMEOUT) * 1000)
+    {
+      ++r_bus.ms_stats.mui32_tpAborted;
+      r_bus.mmap_tpSessions.erase(iter++);
+    }
+    else
+      ++iter;
+  }
+}
+
+// send the complete message of the session to the clients subscribed to its PGN, except its sender
+static void deliverTpMessage(__HAL::server_c* pc_serverData, uint8_t aui8_bus, uint32_t aui32_key, const __HAL::tpSession_s& ar_session, int64_t ai64_rxTime)
+{
+  ++pc_serverData->canBus(aui8_bus).ms_stats.mui32_tpMessages;
+
+  __HAL::transferBuf_s s_header;
+  s_header.ui16_command = COMMAND_TP_DATA;
+  s_header.s_tpMessage.ui32_pgn = ar_session.mui32_pgn;
+  s_header.s_tpMessage.ui32_size = uint32_t(ar_session.mvec_data.size());
+  s_header.s_tpMessage.ui8_bus = aui8_bus;
+  s_header.s_tpMessage.ui8_sa = uint8_t(aui32_key >> 8);
+  s_header.s_tpMessage.ui8_da = uint8_t(aui32_key);
+  s_header.s_tpMessage.ui8_priority = ar_session.mui8_priority;
+
+  for (std::list<__HAL::client_c>::iterator iter = pc_serverData->mlist_clients.begin(); iter != pc_serverData->mlist_clients.end(); ++iter)
+  {
+    if ((&*iter == ar_session.mp_sender) || (aui8_bus >= iter->nCanBusses()))
+      continue;
+    const std::vector<uint32_t> &r_pgns = iter->canBus(aui8_bus).mvec_tpPgns;
+    if ((std::find(r_pgns.begin(), r_pgns.end(), ar_session.mui32_pgn) == r_pgns.end()) &&
+        (std::find(r_pgns.begin(), r_pgns.end(), uint32_t(TP_PGN_ALL)) == r_pgns.end()))
+      continue;
+
+    setClientTimeStamp(*iter, ai64_rxTime, s_header.s_tpMessage.i32_sendTimeStamp, s_header.s_tpMessage.ui16_sendTimeStampHigh);
+    queueTpToClient(pc_serverData, *iter, s_header, ar_session.mvec_data, ai64_rxTime);
+  }
+}
+
+/** Follow the transport protocol sessions of a bus with subscribers, see tpSession_s.
+ *  A broadcast (BAM) is complete with its last packet, a transfer with RTS/CTS with
+ *  the receiver's end of message acknowledge.
+ */
+static void trackTpFrame(__HAL::server_c* pc_serverData, const __HAL::transferBuf_s& ar_transferBuf, __HAL::client_c* ap_sender, int64_t ai64_rxTime)
+{
+  const uint8_t cui8_bus = ar_transferBuf.s_data.ui8_bus;
+  __HAL::server_c::canBus_s &r_bus = pc_serverData->canBus(cui8_bus);
+  const canMsg_s &r_canMsg = ar_transferBuf.s_data.s_canMsg;
+
+  if (!r_bus.mui16_tpSubscribers || !r_canMsg.i32_msgType || (r_canMsg.i32_len != 8))
+    return;
+
+  const uint32_t cui32_dpPf = ISO_DP_PF(r_canMsg.ui32_id);
+  const bool cb_extended = (cui32_dpPf == ISO_PGN_ETP_CM_DP_PF) || (cui32_dpPf == ISO_PGN_ETP_DT_DP_PF);
+  const uint8_t cui8_sa = ISO_SA(r_canMsg.ui32_id);
+  const uint8_t cui8_da = ISO_PS(r_canMsg.ui32_id);
+  const uint8_t *pui8_data = r_canMsg.ui8_data;
+
+  if ((cui32_dpPf == ISO_PGN_TP_DT_DP_PF) || (cui32_dpPf == ISO_PGN_ETP_DT_DP_PF))
+  {
+    const uint32_t cui32_key = __HAL::tpSessionKey(cb_extended, cui8_sa, cui8_da);
+    std::map< uint32_t, __HAL::tpSession_s >::iterator iter = r_bus.mmap_tpSessions.find(cui32_key);
+    if (iter == r_bus.mmap_tpSessions.end())
+      return;
+    __HAL::tpSession_s &r_session = iter->second;
+    // packets are numbered from 1, with ETP relative to the last DPO
+    const uint32_t cui32_packet = r_session.mui32_packetOffset + pui8_data[0];
+    if ((pui8_data[0] == 0) || (cui32_packet > r_session.mvec_havePacket.size()))
+      return;
+
+    r_session.mi64_lastFrame = ai64_rxTime;
+    const size_t cn_offset = size_t(cui32_packet - 1) * 7;
+    memcpy(&r_session.mvec_data[cn_offset], pui8_data + 1, (std::min)(size_t(7), r_session.mvec_data.size() - cn_offset));
+    if (!r_session.mvec_havePacket[cui32_packet - 1])
+    {
+      r_session.mvec_havePacket[cui32_packet - 1] = true;
+      --r_session.mui32_missing;
+    }
+
+    if (!r_session.mui32_missing && (cui8_da == ISO_ADDRESS_GLOBAL))
+    {
+      deliverTpMessage(pc_serverData, cui8_bus, cui32_key, r_session, ai64_rxTime);
+      r_bus.mmap_tpSessions.erase(iter);
+    }
+    return;
+  }
+
+  if ((cui32_dpPf != ISO_PGN_TP_CM_DP_PF) && (cui32_dpPf != ISO_PGN_ETP_CM_DP_PF))
+    return;
+
+  expireTpSessions(r_bus, ai64_rxTime);
+
+  const uint8_t cui8_control = pui8_data[0];
+  uint32_t ui32_size = 0;
+  if (cb_extended && (cui8_control == ISO_ETP_RTS) && (cui8_da != ISO_ADDRESS_GLOBAL))
+  {
+    ui32_size = pui8_data[1] | (uint32_t(pui8_data[2]) << 8) | (uint32_t(pui8_data[3]) << 16) | (uint32_t(pui8_data[4]) << 24);
+    if ((ui32_size <= ISO_TP_MAX_SIZE) || (ui32_size > CAN_SERVER_TP_MAX_SIZE))
+      return;
+  }
+  else if (!cb_extended && (((cui8_control == ISO_TP_RTS) && (cui8_da != ISO_ADDRESS_GLOBAL)) ||
+                            ((cui8_control == ISO_TP_BAM) && (cui8_da == ISO_ADDRESS_GLOBAL))))
+  {
+    ui32_size = pui8_data[1] | (uint32_t(pui8_data[2]) << 8);
+    if ((ui32_size == 0) || (ui32_size > ISO_TP_MAX_SIZE))
+      return;
+  }
+
+  if (ui32_size > 0)
+  { // a new session replaces one still open between the two
+    const uint32_t cui32_key = __HAL::tpSessionKey(cb_extended, cui8_sa, cui8_da);
+    if (r_bus.mmap_tpSessions.count(cui32_key))
+      ++r_bus.ms_stats.mui32_tpAborted;
+    __HAL::tpSession_s &r_session = r_bus.mmap_tpSessions[cui32_key];
+    r_session.mui32_pgn = pui8_data[5] | (uint32_t(pui8_data[6]) << 8) | (uint32_t(pui8_data[7]) << 16);
+    r_session.mui8_priority = uint8_t((r_canMsg.ui32_id >> 26) & 7);
+    r_session.mvec_data.assign(ui32_size, 0);
+    r_session.mui32_missing = (ui32_size + 6) / 7;
+    r_session.mvec_havePacket.assign(r_session.mui32_missing, false);
+    r_session.mui32_packetOffset = 0;
+    r_session.mi64_lastFrame = ai64_rxTime;
+    r_session.mp_sender = ap_sender;
+    return;
+  }
+
+  // the other control messages: DPO from the sender, EoMA from the receiver, abort from either
+  const uint32_t cui32_senderKey = __HAL::tpSessionKey(cb_extended, cui8_sa, cui8_da);
+  const uint32_t cui32_receiverKey = __HAL::tpSessionKey(cb_extended, cui8_da, cui8_sa);
+  const bool cb_eoma = (cui8_control == ISO_TP_EOMA) || (cui8_control == ISO_ETP_EOMA);
+  std::map< uint32_t, __HAL::tpSession_s >::iterator iter = r_bus.mmap_tpSessions.find(cb_eoma ? cui32_receiverKey : cui32_senderKey);
+  if ((iter == r_bus.mmap_tpSessions.end()) && (cui8_control == ISO_TP_ABORT))
+    iter = r_bus.mmap_tpSessions.find(cui32_receiverKey);
+  if (iter == r_bus.mmap_tpSessions.end())
+    return;
+
+  switch (cui8_control)
+  {
+    case ISO_ETP_DPO:
+      if (cb_extended)
+      {
+        iter->second.mui32_packetOffset = pui8_data[2] | (uint32_t(pui8_data[3]) << 8) | (uint32_t(pui8_data[4]) << 16);
+        iter->second.mi64_lastFrame = ai64_rxTime;
+      }
+      break;
+
+    case ISO_TP_EOMA:
+    case ISO_ETP_EOMA:
+      if ((cui8_control == ISO_ETP_EOMA) != cb_extended)
+        break;
+      // packets missed by the server (e.g. frames lost on the way) don't make a message
+      if (!iter->second.mui32_missing)
+        deliverTpMessage(pc_serverData, cui8_bus, iter->first, iter->second, ai64_rxTime);
+      else
+        ++r_bus.ms_stats.mui32_tpAborted;
+      r_bus.mmap_tpSessions.erase(iter);
+      break;
+
+    case ISO_TP_ABORT:
+      ++r_bus.ms_stats.mui32_tpAborted;
+      r_bus.mmap_tpSessions.erase(iter);
+      break;
+  }
+}
+
+// route a message received on a bus (or replayed from a log) to the clients
+static void routeBusMsg(__HAL::server_c* pc_serverData, __HAL::transferBuf_s& s_transferBuf, int64_t ai64_rxTime)
+{
+  __HAL::server_c::canBus_s &r_bus = pc_serverData->canBus(s_transferBuf.s_data.ui8_bus);
+  ++r_bus.ms_stats.mui32_rxFrames;
+  r_bus.ms_stats.mui32_rxBytes += uint32_t(s_transferBuf.s_data.s_canMsg.i32_len);
+  r_bus.ms_load.add(ai64_rxTime, __HAL::canFrameBits(s_transferBuf.s_data.s_canMsg));
+
+  // an address claimed on the physical bus is reachable there only
+  const int ci_claimed = isoClaimedAddress(pc_serverData, s_transferBuf.s_data.ui8_bus, s_transferBuf.s_data.s_canMsg);
+  if (ci_claimed >= 0)
+    pc_serverData->marrb_remoteDestinationAddressInUse[ci_claimed] = true;
+
+  enqueue_msg(&s_transferBuf, 0, pc_serverData, ai64_rxTime);
+  trackTpFrame(pc_serverData, s_transferBuf, NULL, ai64_rxTime);
+
+  if (pc_serverData->mb_logMode) {
+    dumpCanMsg(
+      &s_transferBuf,
+      pc_serverData,
+      ai64_rxTime);
+  }
+
+  if (pc_serverData->mb_monitorMode)
+    monitorCanMsg (&s_transferBuf, ai64_rxTime);
+}
+
+/** Keep the largest send delay of a client on a bus for COMMAND_SEND_DELAY.
+ *  A stored delay that was reported already is negative (see handleCommand()),
+ *  the first delay measured after that starts over.
+ */
+static void updateSendDelay(__HAL::client_c& r_client, uint8_t aui8_bus, const __HAL::busTxQueue_s::entry_s& ar_entry, int64_t ai64_now)
+{
+  int32_t i32_delay;
+  if (r_client.mb_timeUsec)
+  { // 48 bit [usec] time stamp, see transferBuf_s::s_data
+    const int64_t ci64_sendTimeStamp = int64_t((uint64_t(ar_entry.ui16_sendTimeStampHigh) << 32) | uint32_t(ar_entry.i32_sendTimeStamp));
+    i32_delay = int32_t((ai64_now - __HAL::getServerTimeUsecFromClientTime(r_client, ci64_sendTimeStamp)) / 1000);
+  }
+  else
+    i32_delay = int32_t(ai64_now / 1000) - __HAL::getServerTimeFromClientTime(r_client, ar_entry.i32_sendTimeStamp);
+  if (i32_delay < 0)
+    i32_delay = 0; // time stamp taken in the same [msec]
+
+  int32_t &ri32_sendDelay = r_client.canBus(aui8_bus).mi32_sendDelay;
+  if ((ri32_sendDelay < 0) || (i32_delay > ri32_sendDelay))
+    ri32_sendDelay = i32_delay;
+}
+
+// account a frame the CAN device accepted
+static void busTxDone(__HAL::server_c* pc_serverData, uint8_t aui8_bus, const __HAL::busTxQueue_s::entry_s& ar_entry)
+{
+  __HAL::server_c::canBus_s &r_bus = pc_serverData->canBus(aui8_bus);
+  const int64_t ci64_now = __HAL::getTimeUsec();
+  ++r_bus.ms_stats.mui32_txFrames;
+  r_bus.ms_stats.mui32_txBytes += uint32_t(ar_entry.s_canMsg.i32_len);
+  r_bus.ms_load.add(ci64_now, __HAL::canFrameBits(ar_entry.s_canMsg));
+  pc_serverData->marrs_latency[__HAL::LATENCY_CLIENT_TO_BUS].record(ci64_now - ar_entry.i64_rxTime);
+  // clients that don't stamp their frames leave the time stamp at 0
+  if ((ar_entry.p_client != NULL) && ((ar_entry.i32_sendTimeStamp != 0) || (ar_entry.ui16_sendTimeStampHigh != 0)))
+    updateSendDelay(*ar_entry.p_client, aui8_bus, ar_entry, ci64_now);
+}
+
+static void pushBusTx(__HAL::server_c* pc_serverData, __HAL::server_c::canBus_s& r_bus, __HAL::busTxQueue_s::entry_s& ar_entry)
+{
+  __HAL::busTxQueue_s &r_queue = r_bus.ms_txQueue;
+  std::vector<__HAL::busTxQueue_s::entry_s> &r_heap = r_queue.mvec_heap;
+  if (r_heap.capacity() < pc_serverData->mn_busTxQueueSize)
+    r_heap.reserve(pc_serverData->mn_busTxQueueSize);
+
+  if (r_heap.size() >= pc_serverData->mn_busTxQueueSize)
+  {
+    ++r_bus.ms_stats.mui32_txDropped;
+    if (pc_serverData->me_busTxOverflow != __HAL::TX_OVERFLOW_DROP_OLDEST)
+      return;
+    // the oldest isn't necessarily at the front
+    size_t n_oldest = 0;
+    for (size_t n = 1; n < r_heap.size(); ++n)
+    {
+      if (r_heap[n].ui64_seq < r_heap[n_oldest].ui64_seq)
+        n_oldest = n;
+    }
+    r_heap[n_oldest] = r_heap.back();
+    r_heap.pop_back();
+    std::make_heap(r_heap.begin(), r_heap.end(), __HAL::busTxQueue_s::sendsLater_s());
+  }
+
+  ar_entry.i64_queued = pc_serverData->mc_batchClock.nowUsec();
+  ar_entry.ui32_arbitration = pc_serverData->mb_txArbitration ? __HAL::canArbitrationKey(ar_entry.s_canMsg) : 0;
+  ar_entry.ui64_seq = r_queue.mui64_seq++;
+  r_heap.push_back(ar_entry);
+  std::push_heap(r_heap.begin(), r_heap.end(), __HAL::busTxQueue_s::sendsLater_s());
+}
+
+// send a message from a client or the user to its bus, if that's open; what the
+// CAN device doesn't take now is queued for drainBusTx(), so this never waits
+static void sendMsgToBus(__HAL::server_c* pc_serverData, __HAL::transferBuf_s& s_transferBuf, int64_t ai64_rxTime, __HAL::client_c* ap_client)
+{
+  const uint8_t cui8_bus = s_transferBuf.s_data.ui8_bus;
+  if (!isBusOpen(cui8_bus))
+    return;
+
+  if (isIsoLocalTraffic(pc_serverData, cui8_bus, s_transferBuf.s_data.s_canMsg, ap_client))
+  {
+    ++pc_serverData->canBus(cui8_bus).ms_stats.mui32_txLocal;
+    return;
+  }
+
+  __HAL::busTxQueue_s::entry_s s_entry;
+  s_entry.s_canMsg = s_transferBuf.s_data.s_canMsg;
+  s_entry.i64_rxTime = ai64_rxTime;
+  s_entry.p_client = ap_client;
+  s_entry.i32_sendTimeStamp = s_transferBuf.s_data.i32_sendTimeStamp;
+  s_entry.ui16_sendTimeStampHigh = s_transferBuf.s_data.ui16_sendTimeStampHigh;
+
+  __HAL::server_c::canBus_s &r_bus = pc_serverData->canBus(cui8_bus);
+  // frames already waiting go first, with arbitration all frames of this pass compete
+  if (!pc_serverData->mb_txArbitration && (r_bus.ms_txQueue.size() == 0) && sendToBus(cui8_bus, &(s_entry.s_canMsg), pc_serverData))
+    busTxDone(pc_serverData, cui8_bus, s_entry);
+  else
+    pushBusTx(pc_serverData, r_bus, s_entry);
+}
+
+/** Retry the queued frames of all busses until the CAN device refuses one.
+ *  \return true if frames are left
+ */
+static bool drainBusTx(__HAL::server_c* pc_serverData)
+{
+  bool b_pending = false;
+  for (size_t n_bus = 0; n_bus < pc_serverData->nCanBusses(); ++n_bus)
+  {
+    __HAL::server_c::canBus_s &r_bus = pc_serverData->canBus(n_bus);
+    std::vector<__HAL::busTxQueue_s::entry_s> &r_heap = r_bus.ms_txQueue.mvec_heap;
+    if (r_heap.empty())
+      continue;
+
+    if (!isBusOpen(uint8_t(n_bus)))
+    { // closed meanwhile
+      r_bus.ms_stats.mui32_txDropped += uint32_t(r_heap.size());
+      r_heap.clear();
+      continue;
+    }
+
+    const int64_t ci64_now = __HAL::getTimeUsec();
+    while (!r_heap.empty())
+    {
+      __HAL::busTxQueue_s::entry_s &r_entry = r_heap.front();
+      if (sendToBus(uint8_t(n_bus), &r_entry.s_canMsg, pc_serverData))
+        busTxDone(pc_serverData, uint8_t(n_bus), r_entry);
+      else if (ci64_now - r_entry.i64_queued >= 1000 * CAN_SERVER_BUS_TX_TIMEOUT)
+        ++r_bus.ms_stats.mui32_txErrors;
+      else
+        break;
+      std::pop_heap(r_heap.begin(), r_heap.end(), __HAL::busTxQueue_s::sendsLater_s());
+      r_heap.pop_back();
+    }
+    if (!r_heap.empty())
+      b_pending = true;
+  }
+  return b_pending;
+}
+
+// read all pending messages of one CAN bus and forward them to the clients
+static void readBus(__HAL::server_c* pc_serverData, uint8_t ui8_bus)
+{
+  canMsg_s arrs_canMsg[CAN_SERVER_READ_BATCH];
+  int64_t arri64_rxTime[CAN_SERVER_READ_BATCH];
+  __HAL::transferBuf_s s_transferBuf;
+  size_t n_read;
+
+  while((n_read = readFromBusBatch(ui8_bus, arrs_canMsg, arri64_rxTime, CAN_SERVER_READ_BATCH, pc_serverData)) > 0)
+  {
+    if (!isBusOpen(ui8_bus))
+      continue;
+
+    pc_serverData->mc_batchClock.beginBatch();
+
+    for (size_t n = 0; n < n_read; ++n)
+    {
+      s_transferBuf.s_data.s_canMsg = arrs_canMsg[n];
+      s_transferBuf.s_data.ui8_bus = ui8_bus;
+      // the device's receive time stamp if it delivers one
+      const int64_t ci64_rxTime = (arri64_rxTime[n] != CAN_SERVER_RX_TIME_NONE) ? arri64_rxTime[n] : pc_serverData->mc_batchClock.nowUsec();
+      routeBusMsg(pc_serverData, s_transferBuf, ci64_rxTime);
+    }
+    pc_serverData->mc_batchClock.endBatch();
+  }
+}
+
+
+/** Handle one transferBuf_s record received on a command or data socket of a client.
+ *  \return true if the client got released (iter_client then points to the next client)
+ */
+static bool handleClientRecord(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::iterator& iter_client, bool ab_commandSocket, __HAL::transferBuf_s& s_transferBuf)
+{
+  if (ab_commandSocket)
+  {
+    if (s_transferBuf.ui16_command != COMMAND_DATA)
+      return handleCommand(pc_serverData, iter_client, &s_transferBuf);
+  }
+  else if ((s_transferBuf.ui16_command == COMMAND_DATA) && (s_transferBuf.s_data.ui8_bus <= HAL_CAN_MAX_BUS_NR))
+  {
+    // process data message
+    ++iter_client->ms_stats.mui32_rxFrames;
+    const int64_t ci64_rxTime = pc_serverData->mc_batchClock.nowUsec();
+    // to the bus first, enqueue_msg() replaces the client's send time stamp
+    sendMsgToBus(pc_serverData, s_transferBuf, ci64_rxTime, &*iter_client);
+
+    enqueue_msg(&s_transferBuf, iter_client->i32_dataSocket, pc_serverData, ci64_rxTime); // not done any more: disassemble_client_id(msqWriteBuf.i32_mtype)
+    trackTpFrame(pc_serverData, s_transferBuf, &*iter_client, ci64_rxTime);
+
+    if (pc_serverData->mb_logMode) {
+      dumpCanMsg(
+          &s_transferBuf,
+          pc_serverData,
+          ci64_rxTime);
+    }
+    if (pc_serverData->mb_monitorMode)
+    {
+      monitorCanMsg (&s_transferBuf, ci64_rxTime);
+    }
+  }
+  return false;
+}
+
+
+/** Handle one readable command or data socket of a client:
+ *  Drain what's available with a single recv() and handle all complete records.
+ *  \return true if the client got released (iter_client then points to the next client)
+ */
+static bool readClientSocket(__HAL::server_c* pc_serverData, std::list<__HAL::client_c>::iterator& iter_client, bool ab_commandSocket)
+{
+  const SOCKET_TYPE socket = ab_commandSocket ? iter_client->i32_commandSocket : iter_client->i32_dataSocket;
+  __HAL::client_c::rxBuffer_s &r_rx = ab_commandSocket ? iter_client->ms_commandRx : iter_client->ms_dataRx;
+
+  // socket still alive? (returns 0 (peer shutdown) or -1 (error))
+  int bytesRecv = recv(socket, r_rx.arrc_data + r_rx.n_fill, int(sizeof(r_rx.arrc_data) - r_rx.n_fill),
+#ifdef WIN32
+    0);
+#else
+    MSG_DONTWAIT);
+#endif
+
+  if ((bytesRecv == -1) && SOCKET_WOULD_BLOCK())
+    return false; // spurious wake-up, nothing to read yet
+
+  if (bytesRecv == 0 || bytesRecv == -1)
+  {
+    if (pc_serverData->mb_interactive) {
+#ifdef WIN32
+      if( bytesRecv == -1 && WSAGetLastError() == WSAEOPNOTSUPP )
+        printf("The attempted operation is not supported for the type of object referenced.\n");
+#endif
+      printf( "connection closed.\n");
+    }
+    releaseClient(pc_serverData, iter_client);
+    return true;
+  }
+
+  r_rx.n_fill += bytesRecv;
+
+  pc_serverData->mc_batchClock.beginBatch();
+  size_t n_pos = 0;
+  while (r_rx.n_fill - n_pos >= sizeof(__HAL::transferBuf_s))
+  {
+    __HAL::transferBuf_s s_transferBuf;
+    memcpy(&s_transferBuf, r_rx.arrc_data + n_pos, sizeof(__HAL::transferBuf_s));
+    n_pos += sizeof(__HAL::transferBuf_s);
+
+    if (handleClientRecord(pc_serverData, iter_client, ab_commandSocket, s_transferBuf))
+    {
+      pc_serverData->mc_batchClock.endBatch();
+      return true; // r_rx is gone with the client
+    }
+  }
+  pc_serverData->mc_batchClock.endBatch();
+
+  // keep an incomplete record for the next call
+  r_rx.n_fill -= n_pos;
+  if (r_rx.n_fill > 0)
+    memmove(r_rx.arrc_data, r_rx.arrc_data + n_pos, r_rx.n_fill);
+
+  return false;
+}
+
+
+// route and send a message entered by the user (see sendUserMsg)
+static void handleUserMsg(__HAL::server_c* pc_serverData, __HAL::transferBuf_s& s_transferBuf)
+{
+  const int64_t ci64_rxTime = pc_serverData->mc_batchClock.nowUsec();
+  enqueue_msg(&s_transferBuf, 0, pc_serverData, ci64_rxTime);
+  trackTpFrame(pc_serverData, s_transferBuf, NULL, ci64_rxTime);
+
+  sendMsgToBus(pc_serverData, s_transferBuf, ci64_rxTime, NULL);
+
+  if (pc_serverData->mb_logMode)
+  {
+    dumpCanMsg( &s_transferBuf, pc_serverData, ci64_rxTime);
+  }
+  if (pc_serverData->mb_monitorMode)
+  {
+    monitorCanMsg (&s_transferBuf, ci64_rxTime);
+  }
+}
+
+
+/** Copy the statistics for the metrics thread, unless it's still reading the last copy.
+ */
+static void takeMetricsSnapshot(__HAL::server_c* pc_serverData)
+{
+  if (pthread_mutex_trylock( &(pc_serverData->mt_protectMetrics) ) != 0)
+    return;
+
+  __HAL::metricsSnapshot_s &r_metrics = pc_serverData->ms_metrics;
+  r_metrics.mvec_busses.resize(pc_serverData->nCanBusses());
+  const int64_t ci64_now = __HAL::getTimeUsec();
+  for (size_t n_bus = 0; n_bus < pc_serverData->nCanBusses(); ++n_bus)
+  {
+    __HAL::server_c::canBus_s &r_bus = pc_serverData->canBus(n_bus);
+    r_metrics.mvec_busses[n_bus].mb_open = (r_bus.mui16_busRefCnt > 0);
+    r_metrics.mvec_busses[n_bus].ms_stats = r_bus.ms_stats;
+    for (int i = 0; i < __HAL::BUS_LOAD_WINDOWS; ++i)
+      r_metrics.mvec_busses[n_bus].marrui32_load[i] = r_bus.ms_load.load(ci64_now, __HAL::busLoadWindow_e(i), r_bus.mui32_bitrate);
+    r_metrics.mvec_busses[n_bus].mui32_txQueued = uint32_t(r_bus.ms_txQueue.size());
+  }
+
+  r_metrics.mvec_clients.clear();
+  for (std::list<__HAL::client_c>::iterator iter = pc_serverData->mlist_clients.begin(); iter != pc_serverData->mlist_clients.end(); ++iter)
+  {
+    __HAL::metricsSnapshot_s::client_s s_client;
+    s_client.mb_shm = (iter->mp_shm != NULL);
+    s_client.mui32_rxFrames = iter->ms_stats.mui32_rxFrames;
+    s_client.mui32_delivered = iter->ms_stats.mui32_delivered;
+    s_client.mui32_dropped = iter->ms_txQueue.mui32_dropped;
+    s_client.mui32_queued = uint32_t(iter->ms_txQueue.mn_count);
+    s_client.mui32_sendErrors = iter->ms_stats.mui32_sendErrors;
+    r_metrics.mvec_clients.push_back(s_client);
+  }
+
+  memcpy(r_metrics.marrui32_commandCount, pc_serverData->marrui32_commandCount, sizeof(r_metrics.marrui32_commandCount));
+  for (int i = 0; i < __HAL::LATENCY_COUNT; ++i)
+    r_metrics.marrs_latency[i] = pc_serverData->marrs_latency[i];
+  r_metrics.mui32_logDropped = pc_serverData->ms_logQueue.mui32_dropped;
+
+  pthread_mutex_unlock( &(pc_serverData->mt_protectMetrics) );
+}
+
+/** Do the requests of the other threads (see handOverRequest()).
+ */
+static void doHandedRequests(__HAL::server_c* pc_serverData, uint32_t aui32_requests)
+{
+  if (aui32_requests & REQUEST_STATS)
+    printStats(pc_serverData);
+
+  if (aui32_requests & REQUEST_LATENCY)
+  {
+    printLatency(stdout, pc_serverData, false);
+    fflush(stdout);
+  }
+
+  if (aui32_requests & REQUEST_LATENCY_RESET)
+  {
+    for (int i = 0; i < __HAL::LATENCY_COUNT; ++i)
+      pc_serverData->marrs_latency[i].reset();
+  }
+
+  if (aui32_requests & REQUEST_LATENCY_FILE)
+  {
+    FILE *p_file = fopen(pc_serverData->mstr_latencyFile.c_str(), "w");
+    if (p_file)
+    {
+      printLatency(p_file, pc_serverData, true);
+      fclose(p_file);
+    }
+    else
+      std::cerr << "Error: can not open latency file " << pc_serverData->mstr_latencyFile << "." << std::endl;
+  }
+
+  if (aui32_requests & REQUEST_METRICS)
+    takeMetricsSnapshot(pc_serverData);
+
+  // done, see the ab_wait of handOverRequest()
+  pthread_mutex_lock( &(pc_serverData->mt_protectHandOver) );
+  pc_serverData->mui32_requests &= ~aui32_requests;
+  pthread_mutex_unlock( &(pc_serverData->mt_protectHandOver) );
+}
+
+
+/** Take over the clients accepted by collectClient() and the messages of
+ *  sendUserMsg() and of the replay thread. This is the only place where the
+ *  readWrite() thread synchronizes with the other threads.
+ */
+static void takeOverHandedItems(__HAL::server_c* pc_serverData)
+{
+  std::list<__HAL::client_c>::iterator iter_firstNew = pc_serverData->mlist_clients.end();
+  std::vector<__HAL::transferBuf_s> vec_userMsgs;
+  std::vector<__HAL::transferBuf_s> vec_replayMsgs;
+
+  pthread_mutex_lock( &(pc_serverData->mt_protectHandOver) );
+  if (!pc_serverData->mlist_newClients.empty())
+  {
+    iter_firstNew = pc_serverData->mlist_newClients.begin();
+    // splice keeps the elements (and iterators to them), nothing is copied
+    pc_serverData->mlist_clients.splice(pc_serverData->mlist_clients.end(), pc_serverData->mlist_newClients);
+  }
+  vec_userMsgs.swap(pc_serverData->mvec_userMsgs);
+  vec_replayMsgs.swap(pc_serverData->mvec_replayMsgs);
+  const uint32_t cui32_requests = pc_serverData->mui32_requests;
+  pthread_mutex_unlock( &(pc_serverData->mt_protectHandOver) );
+
+#ifdef CAN_SERVER_USE_EPOLL
+  for (std::list<__HAL::client_c>::iterator iter = iter_firstNew; iter != pc_serverData->mlist_clients.end(); ++iter)
+    addClientToEventLoop(pc_serverData, iter);
+#else
+  (void)iter_firstNew;
+#endif
+
+  pc_serverData->mc_batchClock.beginBatch();
+  for (std::vector<__HAL::transferBuf_s>::iterator iter = vec_userMsgs.begin(); iter != vec_userMsgs.end(); ++iter)
+    handleUserMsg(pc_serverData, *iter);
+
+  for (std::vector<__HAL::transferBuf_s>::iterator iter = vec_replayMsgs.begin(); iter != vec_replayMsgs.end(); ++iter)
+    routeBusMsg(pc_serverData, *iter, pc_serverData->mc_batchClock.nowUsec());
+  pc_serverData->mc_batchClock.endBatch();
+
+  if (cui32_requests)
+    doHandedRequests(pc_serverData, cui32_requests);
+}
+
+
+#ifdef CAN_SERVER_USE_SHM
+
+/** Handle the records written by the clients into their shared memory rings.
+ *  (COMMAND_SHM_DOORBELL on the data socket only wakes up readWrite())
+ */
+static void readShmClients(__HAL::server_c* pc_serverData)
+{
+  __HAL::transferBuf_s s_transferBuf;
+
+  for (std::list<__HAL::client_c>::iterator iter_client = pc_serverData->mlist_clients.begin(); iter_client != pc_serverData->mlist_clients.end(); ++iter_client)
+  {
+    if (iter_client->mp_shm == NULL)
+      continue;
+
+    // at most one ring size per pass, so that busy clients don't starve the others
+    pc_serverData->mc_batchClock.beginBatch();
+    for (int i = 0; (i < CAN_SERVER_SHM_RING_SIZE) && __HAL::shmPopFromClient(*iter_client, s_transferBuf); ++i)
+      (void)handleClientRecord(pc_serverData, iter_client, false, s_transferBuf);
+    pc_serverData->mc_batchClock.endBatch();
+  }
+}
+
+// request doorbells from the shared memory clients, true if some have records pending already
+static bool prepareShmWait(__HAL::server_c* pc_serverData)
+{
+  bool b_pending = false;
+  for (std::list<__HAL::client_c>::iterator iter_client = pc_serverData->mlist_clients.begin(); iter_client != pc_serverData->mlist_clients.end(); ++iter_client)
+  {
+    if ((iter_client->mp_shm != NULL) && __HAL::shmPrepareWait(*iter_client))
+      b_pending = true;
+  }
+  return b_pending;
+}
+
+#endif
+
+
+#ifdef CAN_SERVER_USE_EPOLL
+
+static void readWriteEpoll(__HAL::server_c* pc_serverData)
+{
+  struct epoll_event arr_events[EVENT_LOOP_MAX_EVENTS];
+
+  addToEventLoop(pc_serverData, pc_serverData->mi_wakeUpFd, EVENT_LOOP_KIND_WAKEUP, 0);
+
+  for (;;) {
+
+    takeOverHandedItems(pc_serverData);
+    monitorBusLoad(pc_serverData);
+
+    // CAN devices without file handle (e.g. virtual substitutes) have to be polled,
+    // otherwise block until a socket or device is ready or wakeUpReadWrite() is called
+    int i_timeout = -1;
+    for (uint32_t ui32=0; ui32 < pc_serverData->nCanBusses(); ui32++ )
+    {
+      if ((pc_serverData->canBus(ui32).mi32_can_device <= 0) && isBusOpen(ui32))
+        i_timeout = 1;
+    }
+    const bool cb_pollBusses = (i_timeout >= 0);
+
+    // retry the frames the CAN devices didn't take in a millisecond
+    if (drainBusTx(pc_serverData))
+      i_timeout = 1;
+
+    // the bus load is shown in monitor mode also while nothing happens
+    if (pc_serverData->mb_monitorMode && (i_timeout < 0))
+      i_timeout = 1000;
+
+#ifdef CAN_SERVER_USE_SHM
+    if (prepareShmWait(pc_serverData))
+      i_timeout = 0;
+#endif
+
+    const int ci_numEvents = epoll_wait(pc_serverData->mi_epollFd, arr_events, EVENT_LOOP_MAX_EVENTS, i_timeout);
+
+    if ((ci_numEvents < 0) && (errno != EINTR))
+    {
+      perror("epoll_wait");
+      continue;
+    }
+
+    for (int i = 0; i < ci_numEvents; ++i)
+    {
+      if ((arr_events[i].data.u64 >> 32) == EVENT_LOOP_KIND_BUS)
+        readBus(pc_serverData, uint8_t(arr_events[i].data.u64));
+      else if ((arr_events[i].data.u64 >> 32) == EVENT_LOOP_KIND_WAKEUP)
+      {
+        eventfd_t t_count;
+        (void)eventfd_read(pc_serverData->mi_wakeUpFd, &t_count);
+      }
+    }
+
+    if (cb_pollBusses)
+    {
+      for (uint32_t ui32_cnt = 0; ui32_cnt < pc_serverData->nCanBusses(); ui32_cnt++ )
+      {
+        if (pc_serverData->canBus(ui32_cnt).mi32_can_device <= 0)
+          readBus(pc_serverData, ui32_cnt);
+      }
+    }
+
+    for (int i = 0; i < ci_numEvents; ++i)
+    {
+      if ((arr_events[i].data.u64 >> 32) != EVENT_LOOP_KIND_CLIENT)
+        continue;
+
+      const SOCKET_TYPE socket = SOCKET_TYPE(uint32_t(arr_events[i].data.u64));
+      std::map< SOCKET_TYPE, std::list<__HAL::client_c>::iterator >::iterator iter_map = pc_serverData->mmap_clientBySocket.find(socket);
+      if (iter_map == pc_serverData->mmap_clientBySocket.end())
+        continue; // client got released while handling an earlier event of this turn
+
+      std::list<__HAL::client_c>::iterator iter_client = iter_map->second;
+      if (arr_events[i].events & EPOLLOUT)
+        flushClientTx(pc_serverData, *iter_client);
+      if (arr_events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        (void)readClientSocket(pc_serverData, iter_client, socket == iter_client->i32_commandSocket);
+    }
+#ifdef CAN_SERVER_USE_SHM
+    readShmClients(pc_serverData);
+#endif
+    flushPendingClients(pc_serverData);
+    releaseDisconnectedClients(pc_serverData);
+  }
+}
+
+#endif
+
+
+/** Make readWrite() return from waiting and re-evaluate its wait conditions,
+ *  e.g. after the client list or the set of open busses changed.
+ *  (On Windows select() still polls with a short timeout)
+ */
+void wakeUpReadWrite(__HAL::server_c* pc_serverData)
+{
+#ifdef CAN_SERVER_USE_EPOLL
+  (void)eventfd_write(pc_serverData->mi_wakeUpFd, 1);
+#else
+  (void)pc_serverData;
+#endif
+}
+
+void addCanDeviceToEventLoop(uint8_t ui8_bus, __HAL::server_c* pc_serverData)
+{
+#ifdef CAN_SERVER_USE_EPOLL
+  const int32_t ci32_device = pc_serverData->canBus(ui8_bus).mi32_can_device;
+  if ((ci32_device <= 0) || (ci32_device == pc_serverData->canBus(ui8_bus).mi32_can_deviceInEventLoop))
+    return;
+
+  removeCanDeviceFromEventLoop(ui8_bus, pc_serverData);
+  addToEventLoop(pc_serverData, ci32_device, EVENT_LOOP_KIND_BUS, ui8_bus);
+  pc_serverData->canBus(ui8_bus).mi32_can_deviceInEventLoop = ci32_device;
+#else
+  (void)ui8_bus;
+  (void)pc_serverData;
+#endif
+}
+
+void removeCanDeviceFromEventLoop(uint8_t ui8_bus, __HAL::server_c* pc_serverData)
+{
+#ifdef CAN_SERVER_USE_EPOLL
+  if (pc_serverData->canBus(ui8_bus).mi32_can_deviceInEventLoop <= 0)
+    return;
+
+  removeFromEventLoop(pc_serverData, pc_serverData->canBus(ui8_bus).mi32_can_deviceInEventLoop);
+  pc_serverData->canBus(ui8_bus).mi32_can_deviceInEventLoop = -1;
+#else
+  (void)ui8_bus;
+  (void)pc_serverData;
+#endif
+}
+
+
 void readWrite(__HAL::server_c* pc_serverData)
 {
+#ifdef CAN_SERVER_USE_EPOLL
+  readWriteEpoll(pc_serverData);
+#else
   fd_set rfds;
-  __HAL::transferBuf_s s_transferBuf;
+  fd_set wfds;
   int i_selectResult;
   struct timeval t_timeout;
   bool b_anyFdSet;
@@ -725,9 +2366,12 @@ void readWrite(__HAL::server_c* pc_serverData)
 
   for (;;) {
 
-    pthread_mutex_lock( &(pc_serverData->mt_protectClientList) );
+    takeOverHandedItems(pc_serverData);
+    monitorBusLoad(pc_serverData);
+    (void)drainBusTx(pc_serverData);
 
     FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
     b_anyFdSet = false;
 
     std::list<__HAL::client_c>::iterator iter_client;
@@ -735,6 +2379,8 @@ void readWrite(__HAL::server_c* pc_serverData)
     {
       FD_SET(iter_client->i32_commandSocket, &rfds);
       FD_SET(iter_client->i32_dataSocket, &rfds);
+      if (iter_client->ms_txQueue.mb_waitWritable)
+        FD_SET(iter_client->i32_dataSocket, &wfds);
       b_anyFdSet = true;
     }
 
@@ -756,16 +2402,13 @@ void readWrite(__HAL::server_c* pc_serverData)
 #endif
     }
 
-    // from now on: no access to client list => unlock mutex
-    pthread_mutex_unlock( &(pc_serverData->mt_protectClientList) );
-
     t_timeout.tv_sec = 0;
     t_timeout.tv_usec = 1000;
 
     // timeout to check for
     // 1. modified client list => new sockets to wait for
     // new incoming can messages when can device has no file handle (WIN32 PEAK can card and RTE)
-    i_selectResult = select(FD_SETSIZE, &rfds, NULL, NULL, &t_timeout);
+    i_selectResult = select(FD_SETSIZE, &rfds, &wfds, NULL, &t_timeout);
 
     if(i_selectResult < 0)
     {
@@ -775,119 +2418,23 @@ void readWrite(__HAL::server_c* pc_serverData)
     // new message from can device ?
     for (uint32_t ui32_cnt = 0; ui32_cnt < pc_serverData->nCanBusses(); ui32_cnt++ )
     {
-      while(readFromBus(ui32_cnt, &(s_transferBuf.s_data.s_canMsg), pc_serverData))
-      {
-        if (!isBusOpen(ui32_cnt))
-          continue;
-
-        pthread_mutex_lock( &(pc_serverData->mt_protectClientList) );
-        s_transferBuf.s_data.ui8_bus = ui32_cnt;
-        enqueue_msg(&s_transferBuf, 0, pc_serverData);
-        pthread_mutex_unlock( &(pc_serverData->mt_protectClientList) );
-
-        if (pc_serverData->mb_logMode) {
-          dumpCanMsg(
-            &s_transferBuf,
-            pc_serverData);
-        }
-
-        if (pc_serverData->mb_monitorMode)
-          monitorCanMsg (&s_transferBuf);
-       }
+      readBus(pc_serverData, ui32_cnt);
     }
 
-    pthread_mutex_lock( &(pc_serverData->mt_protectClientList) );
     // new message from socket ?
     for (iter_client = pc_serverData->mlist_clients.begin(); iter_client != pc_serverData->mlist_clients.end(); )
     {
+      if (FD_ISSET(iter_client->i32_dataSocket, &wfds))
+        flushClientTx(pc_serverData, *iter_client);
       if (FD_ISSET(iter_client->i32_commandSocket, &rfds))
       {
-        // socket still alive? (returns 0 (peer shutdown) or -1 (error))
-#ifdef WINCE
-        // @todo WINCE-176 Windows CE has a bug with MSG_PEEK (bytes are actually read)
-        //int bytesRecv = select( 0, &rfds, NULL, NULL, 0 ); // this was a try for a workaround
-        #error "This place has to be done correctly for Windows CE"
-#else
-        int bytesRecv = recv(iter_client->i32_commandSocket, (char*)&s_transferBuf, sizeof(__HAL::transferBuf_s),
-        #ifndef WIN32
-          MSG_DONTWAIT|
-        #endif
-          MSG_PEEK);
-#endif
-        if (bytesRecv == 0 || bytesRecv == -1)
-        {
-          if (pc_serverData->mb_interactive) {
-#ifdef WIN32
-            if( bytesRecv == -1 && WSAGetLastError() == WSAEOPNOTSUPP )
-              printf("The attempted operation is not supported for the type of object referenced.\n");
-#endif
-            printf( "connection closed.\n");
-          }
-          releaseClient(pc_serverData, iter_client);
-          continue;
-        }
-
-        read_data(iter_client->i32_commandSocket, (char*)&s_transferBuf, sizeof(s_transferBuf));
-
-        if (s_transferBuf.ui16_command != COMMAND_DATA)
-        {
-          const bool clientReleased =
-            handleCommand(pc_serverData, iter_client, &s_transferBuf);
-
-          if( clientReleased )
-            continue; // no "++iter" then, iter_client was "moved on" with the erase inside of the releaseClient()-call!
-        }
+        if (readClientSocket(pc_serverData, iter_client, true))
+          continue; // no "++iter" then, iter_client was "moved on" with the erase inside of the releaseClient()-call!
       }
       if (FD_ISSET(iter_client->i32_dataSocket, &rfds))
       {
-        // socket still alive? (returns 0 (peer shutdown) or -1 (error))
-#ifdef WINCE
-        // @todo WINCE-176 Windows CE has a bug with MSG_PEEK (bytes are actually read)
-        //int bytesRecv = select( 0, &rfds, NULL, NULL, 0 ); // this was a try for a workaround
-        #error "This place has to be done correctly for Windows CE"
-#else
-        int bytesRecv = recv(iter_client->i32_dataSocket, (char*)&s_transferBuf, sizeof(__HAL::transferBuf_s),
-        #ifndef WIN32
-          MSG_DONTWAIT|
-        #endif
-          MSG_PEEK);
-#endif
-
-        if (bytesRecv == 0 || bytesRecv == -1)
-        {
-          if (pc_serverData->mb_interactive) {
-#ifdef WIN32
-            if( bytesRecv == -1 && WSAGetLastError() == WSAEOPNOTSUPP )
-              printf("The attempted operation is not supported for the type of object referenced.\n");
-#endif
-            printf( "connection closed.\n");
-          }
-          releaseClient(pc_serverData, iter_client);
+        if (readClientSocket(pc_serverData, iter_client, false))
           continue;
-        }
-
-        read_data(iter_client->i32_dataSocket, (char*)&s_transferBuf, sizeof(s_transferBuf));
-
-        if (s_transferBuf.ui16_command == COMMAND_DATA)
-        {
-          // process data message
-          enqueue_msg(&s_transferBuf, iter_client->i32_dataSocket, pc_serverData); // not done any more: disassemble_client_id(msqWriteBuf.i32_mtype)
-          
-          if (isBusOpen(s_transferBuf.s_data.ui8_bus))
-          {
-            (void)sendToBus(s_transferBuf.s_data.ui8_bus, &(s_transferBuf.s_data.s_canMsg), pc_serverData);
-          }
-
-          if (pc_serverData->mb_logMode) {
-            dumpCanMsg(
-                &s_transferBuf,
-                pc_serverData);
-          }
-          if (pc_serverData->mb_monitorMode)
-          {
-            monitorCanMsg (&s_transferBuf);
-          }
-        }
       }
 
       // if the client wasn't released (and hence "iter = list.erase(iter);" was called),
@@ -895,9 +2442,11 @@ void readWrite(__HAL::server_c* pc_serverData)
       ++iter_client;
     } // for
 
-    pthread_mutex_unlock( &(pc_serverData->mt_protectClientList) );
+    flushPendingClients(pc_serverData);
+    releaseDisconnectedClients(pc_serverData);
 
   }
+#endif
 }
 
 
@@ -913,28 +2462,50 @@ void sendUserMsg(uint32_t DLC, uint32_t ui32_id, uint32_t ui32_bus, uint8_t ui8_
 
   s_transferBuf.s_data.ui8_bus = ui32_bus;
 
-  // acquire mutex (prevents concurrent read/write access to can driver and modification of client list during execution of enqueue_msg
-  pthread_mutex_lock( &(pc_serverData->mt_protectClientList) );
+  // the message is routed and sent by readWrite(), which owns the clients and the CAN driver
+  pthread_mutex_lock( &(pc_serverData->mt_protectHandOver) );
+  pc_serverData->mvec_userMsgs.push_back(s_transferBuf);
+  pthread_mutex_unlock( &(pc_serverData->mt_protectHandOver) );
 
-  enqueue_msg(&s_transferBuf, 0, pc_serverData);
+  wakeUpReadWrite(pc_serverData);
+}
 
-  if (isBusOpen(s_transferBuf.s_data.ui8_bus))
-  {
-    (void)sendToBus(s_transferBuf.s_data.ui8_bus, &(s_transferBuf.s_data.s_canMsg), pc_serverData);
-  }
+void handOverRequest(uint32_t aui32_request, __HAL::server_c* pc_serverData, bool ab_wait)
+{
+  pthread_mutex_lock( &(pc_serverData->mt_protectHandOver) );
+  pc_serverData->mui32_requests |= aui32_request;
+  pthread_mutex_unlock( &(pc_serverData->mt_protectHandOver) );
 
-  pthread_mutex_unlock( &(pc_serverData->mt_protectClientList) );
-  
-  if (pc_serverData->mb_logMode)
-  {
-    dumpCanMsg( &s_transferBuf, pc_serverData);
-  }
-  if (pc_serverData->mb_monitorMode)
+  wakeUpReadWrite(pc_serverData);
+
+  for (int i = 0; ab_wait && (i < 200); ++i)
   {
-    monitorCanMsg (&s_transferBuf);
+    pthread_mutex_lock( &(pc_serverData->mt_protectHandOver) );
+    const bool cb_pending = (pc_serverData->mui32_requests & aui32_request) != 0;
+    pthread_mutex_unlock( &(pc_serverData->mt_protectHandOver) );
+    if (!cb_pending)
+      break;
+#ifdef WIN32
+    Sleep( 10 );
+#else
+    usleep( 10000 );
+#endif
   }
 }
 
+size_t handOverReplayMsgs(std::vector<__HAL::transferBuf_s>& arvec_msgs, __HAL::server_c* pc_serverData)
+{
+  pthread_mutex_lock( &(pc_serverData->mt_protectHandOver) );
+  std::vector<__HAL::transferBuf_s> &r_pending = pc_serverData->mvec_replayMsgs;
+  r_pending.insert(r_pending.end(), arvec_msgs.begin(), arvec_msgs.end());
+  const size_t cn_pending = r_pending.size();
+  pthread_mutex_unlock( &(pc_serverData->mt_protectHandOver) );
+
+  arvec_msgs.clear();
+  wakeUpReadWrite(pc_serverData);
+  return cn_pending;
+}
+
 
 
 /////////////////////////////////////////////////////////////////////////
@@ -1070,12 +2641,21 @@ static void* collectClient(void* ptr) {
 #endif
 
     s_tmpClient.i32_dataSocket = new_socket;
+    s_tmpClient.ms_txQueue.mvec_ring.resize(pc_serverData->mn_clientTxQueueSize);
+    s_tmpClient.ms_txQueue.mvec_stamp.resize(pc_serverData->mn_clientTxQueueSize);
 
-    pthread_mutex_lock( &(pc_serverData->mt_protectClientList) );
+#ifdef WIN32
+    // the TX queue is flushed without blocking
+    u_long ul_nonBlocking = 1;
+    (void)ioctlsocket(new_socket, FIONBIO, &ul_nonBlocking);
+#endif
 
-    pc_serverData->mlist_clients.push_back(s_tmpClient);
+    // readWrite() adds the client to its list and event loop
+    pthread_mutex_lock( &(pc_serverData->mt_protectHandOver) );
+    pc_serverData->mlist_newClients.push_back(s_tmpClient);
+    pthread_mutex_unlock( &(pc_serverData->mt_protectHandOver) );
 
-    pthread_mutex_unlock( &(pc_serverData->mt_protectClientList) );
+    wakeUpReadWrite(pc_serverData);
 
     if (pc_serverData->mb_interactive) {
       printf("Command and data socket connected.\n");
@@ -1086,11 +2666,27 @@ static void* collectClient(void* ptr) {
 yasper::ptr< AOption_c > const ga_options[] = {
   Option_c< OPTION_MONITOR >::create(),
   Option_c< OPTION_LOG >::create(),
+  Option_c< OPTION_LOG_FORMAT >::create(),
+  Option_c< OPTION_FILE_INPUT >::create(),
+  Option_c< OPTION_REPLAY_SPEED >::create(),
+  Option_c< OPTION_REPLAY_LOOP >::create(),
+  Option_c< OPTION_REPLAY_BUS_MAP >::create(),
   Option_c< OPTION_REDUCED_LOAD_ISO_BUS_NO >::create(),
   Option_c< OPTION_INTERACTIVE >::create(),
   Option_c< OPTION_PRODUCTIVE >::create(),
   Option_c< OPTION_INITIAL_CAN_OPEN >::create(),
   Option_c< OPTION_VIRTUAL_CAN_SUBSTITUTE >::create(),
+  Option_c< OPTION_TX_QUEUE_SIZE >::create(),
+  Option_c< OPTION_TX_OVERFLOW >::create(),
+  Option_c< OPTION_TX_BATCH_LATENCY >::create(),
+  Option_c< OPTION_BUS_TX_QUEUE_SIZE >::create(),
+  Option_c< OPTION_BUS_TX_OVERFLOW >::create(),
+  Option_c< OPTION_TX_ARBITRATION >::create(),
+  Option_c< OPTION_LATENCY_FILE >::create(),
+  Option_c< OPTION_METRICS_PORT >::create(),
+#ifndef WIN32
+  Option_c< OPTION_METRICS_SOCKET >::create(),
+#endif
 #ifndef WIN32
   Option_c< OPTION_DAEMON>::create(),
 #endif
@@ -1118,6 +2714,19 @@ int main(int argc, char *argv[])
   }
 #endif
 
+#ifdef CAN_SERVER_USE_EPOLL
+  c_serverData.mi_epollFd = epoll_create(EVENT_LOOP_MAX_EVENTS); // size is only a hint
+  if (c_serverData.mi_epollFd < 0) {
+    perror("epoll_create");
+    exit(1);
+  }
+  c_serverData.mi_wakeUpFd = eventfd(0, EFD_NONBLOCK);
+  if (c_serverData.mi_wakeUpFd < 0) {
+    perror("eventfd");
+    exit(1);
+  }
+#endif
+
   (void)pthread_create( &threadCollectClient, NULL, &collectClient, &c_serverData);
 
   if (c_serverData.mb_interactive) {
@@ -1130,8 +2739,21 @@ int main(int argc, char *argv[])
     }
   }
 
+  if (c_serverData.mb_logMode)
+    startLogWriter(&c_serverData);
+
   initialCanOpen(&c_serverData);
 
+  if (c_serverData.mb_inputFileMode)
+    startReplay(&c_serverData);
+
+#ifdef WIN32
+  if (c_serverData.mi_metricsPort > 0)
+#else
+  if ((c_serverData.mi_metricsPort > 0) || !c_serverData.mstr_metricsSocket.empty())
+#endif
+    startMetrics(&c_serverData);
+
   readWrite(&c_serverData);
 }
 
@@ -0,0 +1,50 @@
+/*
+  can_server_atomic.h: Minimal atomic access for single producer /
+    single consumer queues between the CAN-Server threads
+
+  (C) Copyright 2009 - 2022 by OSB connagtive GmbH
+
+  Use, modification and distribution are subject to the GNU General
+  Public License, see accompanying file LICENSE.txt
+*/
+#ifndef CAN_SERVER_ATOMIC_H
+#define CAN_SERVER_ATOMIC_H
+
+#include "can_server_interface.h"
+
+#if defined(_MSC_VER)
+  #include <intrin.h>
+#endif
+
+namespace __HAL {
+
+#if defined(_MSC_VER)
+  // aligned 32 bit accesses are atomic on x86/x64, the compiler barriers
+  // keep the data accesses on the right side of the index access
+  inline uint32_t atomicLoadAcquire(volatile uint32_t const *ap_value)
+  {
+    const uint32_t cui32_value = *ap_value;
+    _ReadWriteBarrier();
+    return cui32_value;
+  }
+
+  inline void atomicStoreRelease(volatile uint32_t *ap_value, uint32_t aui32_value)
+  {
+    _ReadWriteBarrier();
+    *ap_value = aui32_value;
+  }
+#else
+  inline uint32_t atomicLoadAcquire(volatile uint32_t const *ap_value)
+  {
+    return __atomic_load_n(ap_value, __ATOMIC_ACQUIRE);
+  }
+
+  inline void atomicStoreRelease(volatile uint32_t *ap_value, uint32_t aui32_value)
+  {
+    __atomic_store_n(ap_value, aui32_value, __ATOMIC_RELEASE);
+  }
+#endif
+
+} // end namespace
+
+#endif
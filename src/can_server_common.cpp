@@ -10,6 +10,7 @@
 
 #include "can_server_common.h"
 #include "can_filtering.h"
+#include "can_server_atomic.h"
 
 #include <iostream>
 #include <sstream>
@@ -24,6 +25,7 @@
 #else
 #include <unistd.h>
 #include <sys/times.h>
+#include <sys/time.h>
 #endif
 
 
@@ -127,6 +129,7 @@ static std::string readInputLine()
 }
 static void enableLog( __HAL::server_c *p_server )
 {
+  startLogWriter( p_server );
   for (size_t n_bus = 0; n_bus < p_server->nCanBusses(); ++n_bus) {
     if (0 < p_server->canBus(n_bus).mui16_busRefCnt) {
       (void)newFileLog( p_server, n_bus );
@@ -139,10 +142,12 @@ static void disableLog( __HAL::server_c *p_server )
 {
   p_server->mb_logMode = false;
 
+  pthread_mutex_lock( &p_server->mt_protectLogFiles );
   for (size_t n_canBusses = p_server->nCanBusses(); 0 < n_canBusses; ) {
     --n_canBusses;
     p_server->canBus(n_canBusses).m_logFile = __HAL::LogFile_c::Null_s()();
   }
+  pthread_mutex_unlock( &p_server->mt_protectLogFiles );
 }
 
 void *readUserInput( void *ap_arg )
@@ -160,6 +165,9 @@ void *readUserInput( void *ap_arg )
   static char const s_send_short[] = "s";
   static char const s_filter[] = "filter";
   static char const s_filter_short[] = "f";
+  static char const s_stats[] = "stats";
+  static char const s_latency[] = "latency";
+  static char const s_reset[] = "reset";
   __HAL::server_c *pc_serverData = static_cast< __HAL::server_c * >(ap_arg);
   for (;;) {
     std::string inputline = readInputLine();
@@ -196,8 +204,25 @@ void *readUserInput( void *ap_arg )
       }
     } else if (!s_command.compare( s_quit ) || !s_command.compare( s_exit )) {
       std::cerr << "Exiting CAN-Server..." << std::endl;
+      if (!pc_serverData->mstr_latencyFile.empty())
+        handOverRequest( REQUEST_LATENCY_FILE, pc_serverData, true );
+      stopLogWriter( pc_serverData );
       exit(0);
     }
+    else if (!s_command.compare( s_stats )) { // before "s", the short form of "send"
+      handOverRequest( REQUEST_STATS, pc_serverData );
+    }
+    else if (!s_command.compare( s_latency )) {
+      std::string s_option;
+      istr_inputLine >> s_option;
+      if (s_option.empty()) {
+        handOverRequest( REQUEST_LATENCY, pc_serverData );
+      } else if (!s_option.compare( s_reset )) {
+        handOverRequest( REQUEST_LATENCY_RESET, pc_serverData );
+      } else {
+        b_needHelp = true;
+      }
+    }
     else if (s_command.compare(0, strlen(s_filter), s_filter ) == 0) {
       int startPos = size_ignore+strlen(s_filter);
       while( inputline[ startPos ] == ' ' )
@@ -261,9 +286,9 @@ void *readUserInput( void *ap_arg )
           ++i_len;
         }
 
-        if (i_bus < 0 || i_bus > 255)
+        if (i_bus < 0 || i_bus > HAL_CAN_MAX_BUS_NR)
         {
-          std::cout << "ERROR: invalid bus. Valid range is 0..FF" << std::endl;
+          std::cout << "ERROR: invalid bus. Valid range is 0.." << HAL_CAN_MAX_BUS_NR << std::endl;
           b_needHelp = true;
         }
 
@@ -297,6 +322,8 @@ void *readUserInput( void *ap_arg )
         "  " << s_off << " ... (see " << s_disable << " ...)" << std::endl <<
         "  " << s_filter << "|"<< s_filter_short << " ... (see \"" << s_filter << " help\")" << std::endl <<
         "  " << "send|s[<reapeat count>] s|std|standard|x|ext|extended <bus(dec)> <ID(hex)> DB1 DB2 .. DB8" << std::endl <<
+        "  " << s_stats << " (frames per bus and client, commands)" << std::endl <<
+        "  " << s_latency << " [" << s_reset << "] (forwarding latency percentiles)" << std::endl <<
         "  " << s_help << std::endl;
     }
   }
@@ -375,15 +402,196 @@ std::string Option_c< OPTION_LOG >::doGetUsage() const
   return "  --log LOG_FILE_NAME_BASE   Log can traffic into <LOG_FILE_NAME_BASE>_<bus_id>\n";
 }
 
+static const char *const sarr_logFormatNames[] = { "text", "binary" };
+
+template <>
+int Option_c< OPTION_LOG_FORMAT >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--log-format")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    if (!strcmp(argv[ai_pos+1], sarr_logFormatNames[CAN_LOG_FORMAT_TEXT]))
+      ar_server.me_logFormat = CAN_LOG_FORMAT_TEXT;
+    else if (!strcmp(argv[ai_pos+1], sarr_logFormatNames[CAN_LOG_FORMAT_BINARY]))
+      ar_server.me_logFormat = CAN_LOG_FORMAT_BINARY;
+    else {
+      std::cerr << "error: unknown log format " << argv[ai_pos+1] << std::endl;
+      exit(1);
+    }
+    return 2;
+  }
+  return 0;
+}
+
+template <>
+std::string Option_c< OPTION_LOG_FORMAT >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  if (ar_server.mb_logMode) {
+    ostr_setting << "Log format: " << sarr_logFormatNames[ar_server.me_logFormat] << std::endl;
+  }
+  return ostr_setting.str();
+}
+
+template <>
+std::string Option_c< OPTION_LOG_FORMAT >::doGetUsage() const
+{
+  return
+    "  --log-format text|binary   Format of the log files (default text), binary\n"
+    "                             logs are converted to text with can_log_convert\n";
+}
+
+template <>
+int Option_c< OPTION_FILE_INPUT >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--file-input")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    ar_server.mstr_inputFile = argv[ai_pos+1];
+    ar_server.mb_inputFileMode=true;
+    return 2;
+  }
+  return 0;
+}
+
+template <>
+std::string Option_c< OPTION_FILE_INPUT >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  if (ar_server.mb_inputFileMode) {
+    ostr_setting << "Replaying " << ar_server.mstr_inputFile << std::endl;
+  }
+  return ostr_setting.str();
+}
+
+template <>
+std::string Option_c< OPTION_FILE_INPUT >::doGetUsage() const
+{
+  return
+    "  --file-input LOG_FILE      Replay a log file (text or binary) as traffic\n"
+    "                             received on the buses, starting when the first\n"
+    "                             client opens a bus\n";
+}
+
+template <>
+int Option_c< OPTION_REPLAY_SPEED >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--replay-speed")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    ar_server.md_replaySpeed = atof(argv[ai_pos+1]);
+    if (ar_server.md_replaySpeed < 0) {
+      std::cerr << "error: replay speed must not be negative" << std::endl;
+      exit(1);
+    }
+    return 2;
+  }
+  return 0;
+}
+
+template <>
+std::string Option_c< OPTION_REPLAY_SPEED >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  if (ar_server.mb_inputFileMode) {
+    if (ar_server.md_replaySpeed > 0)
+      ostr_setting << "Replay speed factor " << ar_server.md_replaySpeed << std::endl;
+    else
+      ostr_setting << "Replaying as fast as possible" << std::endl;
+  }
+  return ostr_setting.str();
+}
+
+template <>
+std::string Option_c< OPTION_REPLAY_SPEED >::doGetUsage() const
+{
+  return
+    "  --replay-speed FACTOR      Replay FACTOR times faster than recorded\n"
+    "                             (default 1, 0 = as fast as possible)\n";
+}
+
+template <>
+int Option_c< OPTION_REPLAY_LOOP >::doCheckAndHandle(int /*argc*/, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--replay-loop")) {
+    ar_server.mb_replayLoop = true;
+    return 1;
+  }
+  return 0;
+}
+
+template <>
+std::string Option_c< OPTION_REPLAY_LOOP >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  return (ar_server.mb_inputFileMode && ar_server.mb_replayLoop) ? "Replaying in a loop.\n" : "";
+}
+
+template <>
+std::string Option_c< OPTION_REPLAY_LOOP >::doGetUsage() const
+{
+  return "  --replay-loop              Restart the replay at the end of the log file\n";
+}
+
+template <>
+int Option_c< OPTION_REPLAY_BUS_MAP >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--replay-bus-map")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    std::istringstream istr_map( argv[ai_pos+1] );
+    std::string str_pair;
+    while (std::getline( istr_map, str_pair, ',' )) {
+      unsigned u_from, u_to;
+      if ((sscanf( str_pair.c_str(), "%u:%u", &u_from, &u_to ) != 2) ||
+          (u_from >= HAL_CAN_MAX_BUS_NR) || (u_to >= HAL_CAN_MAX_BUS_NR)) {
+        std::cerr << "error: invalid bus mapping " << str_pair << std::endl;
+        exit(1);
+      }
+      ar_server.marrui8_replayBusMap[u_from] = uint8_t(u_to);
+    }
+    return 2;
+  }
+  return 0;
+}
+
+template <>
+std::string Option_c< OPTION_REPLAY_BUS_MAP >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  if (ar_server.mb_inputFileMode) {
+    for (unsigned u_bus = 0; u_bus < HAL_CAN_MAX_BUS_NR; ++u_bus) {
+      if (ar_server.marrui8_replayBusMap[u_bus] != u_bus)
+        ostr_setting << "Replaying bus " << u_bus << " on bus " << unsigned(ar_server.marrui8_replayBusMap[u_bus]) << std::endl;
+    }
+  }
+  return ostr_setting.str();
+}
+
+template <>
+std::string Option_c< OPTION_REPLAY_BUS_MAP >::doGetUsage() const
+{
+  return
+    "  --replay-bus-map FROM:TO[,FROM:TO...]\n"
+    "                             Replay the frames logged for bus FROM on bus TO\n";
+}
+
 template <>
 int Option_c< OPTION_REDUCED_LOAD_ISO_BUS_NO >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
 {
   if (!strcmp(argv[ai_pos], "--reduced-load-iso-bus-no")) {
-    ar_server.mi16_reducedLoadOnIsoBus = atoi(argv[ai_pos+1]);
     if (ai_pos+1>=argc) {
       std::cerr << "error: option needs second parameter" << std::endl;
       exit(1);
     }
+    ar_server.mi16_reducedLoadOnIsoBus = atoi(argv[ai_pos+1]);
     return 2;
   }
   return 0;
@@ -407,8 +615,9 @@ std::string Option_c< OPTION_REDUCED_LOAD_ISO_BUS_NO >::doGetUsage() const
     "  --reduced-load-iso-bus-no BUS_NUMBER\n"
     "                             Don't send internal traffic to the physical\n"
     "                             CAN-Bus and thus reduce the load on the specified\n"
-    "                             (ISOBUS) bus number. This is detected by source\n"
-    "                             and destination addresses in the identifier\n";
+    "                             (ISOBUS) bus number. Destination specific messages\n"
+    "                             to an address claimed by a client and not seen on\n"
+    "                             the physical bus are only forwarded to the clients\n";
 }
 
 template <>
@@ -486,7 +695,7 @@ int Option_c< OPTION_INITIAL_CAN_OPEN >::doCheckAndHandle(int argc, char *argv[]
 
     int bus = 0;
     std::stringstream(arg2) >> bus;
-    if(bus >= 0)
+    if((bus >= 0) && (bus <= HAL_CAN_MAX_BUS_NR))
     {
       data.bus_number = bus;
       ar_server.m_l_initialOpenChannelData.push_back(data);
@@ -541,6 +750,314 @@ std::string Option_c< OPTION_VIRTUAL_CAN_SUBSTITUTE >::doGetUsage() const
 #endif
 }
 
+template <>
+int Option_c< OPTION_TX_QUEUE_SIZE >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--tx-queue-size")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    const int ci_size = atoi(argv[ai_pos+1]);
+    if (ci_size < 2) {
+      std::cerr << "error: TX queue size must be at least 2" << std::endl;
+      exit(1);
+    }
+    ar_server.mn_clientTxQueueSize = ci_size;
+    return 2;
+  }
+  return 0;
+}
+
+template <>
+std::string Option_c< OPTION_TX_QUEUE_SIZE >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  ostr_setting << "TX queue size per client: " << ar_server.mn_clientTxQueueSize << " messages" << std::endl;
+  return ostr_setting.str();
+}
+
+template <>
+std::string Option_c< OPTION_TX_QUEUE_SIZE >::doGetUsage() const
+{
+  return
+    "  --tx-queue-size SIZE       Number of messages buffered per client when its\n"
+    "                             socket is not writable (default 256)\n";
+}
+
+static char const *const sarr_txOverflowNames[] = { "drop-newest", "drop-oldest", "disconnect" };
+
+template <>
+int Option_c< OPTION_TX_OVERFLOW >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--tx-overflow")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    if (!strcmp(argv[ai_pos+1], sarr_txOverflowNames[__HAL::TX_OVERFLOW_DROP_NEWEST]))
+      ar_server.me_clientTxOverflow = __HAL::TX_OVERFLOW_DROP_NEWEST;
+    else if (!strcmp(argv[ai_pos+1], sarr_txOverflowNames[__HAL::TX_OVERFLOW_DROP_OLDEST]))
+      ar_server.me_clientTxOverflow = __HAL::TX_OVERFLOW_DROP_OLDEST;
+    else if (!strcmp(argv[ai_pos+1], sarr_txOverflowNames[__HAL::TX_OVERFLOW_DISCONNECT]))
+      ar_server.me_clientTxOverflow = __HAL::TX_OVERFLOW_DISCONNECT;
+    else {
+      std::cerr << "error: unknown TX overflow policy " << argv[ai_pos+1] << std::endl;
+      exit(1);
+    }
+    return 2;
+  }
+  return 0;
+}
+
+template <>
+std::string Option_c< OPTION_TX_OVERFLOW >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  ostr_setting << "TX queue overflow policy: " << sarr_txOverflowNames[ar_server.me_clientTxOverflow] << std::endl;
+  return ostr_setting.str();
+}
+
+template <>
+std::string Option_c< OPTION_TX_OVERFLOW >::doGetUsage() const
+{
+  return
+    "  --tx-overflow drop-newest|drop-oldest|disconnect\n"
+    "                             What to do when a client's TX queue is full\n"
+    "                             (default drop-newest)\n";
+}
+
+template <>
+int Option_c< OPTION_TX_BATCH_LATENCY >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--tx-batch-latency")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    ar_server.mi32_txBatchLatency = atoi(argv[ai_pos+1]);
+    return 2;
+  }
+  return 0;
+}
+
+template <>
+std::string Option_c< OPTION_TX_BATCH_LATENCY >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  if (ar_server.mi32_txBatchLatency > 0) {
+    ostr_setting << "Batching messages to clients, max. latency " <<
+      ar_server.mi32_txBatchLatency << " ms" << std::endl;
+  }
+  return ostr_setting.str();
+}
+
+template <>
+std::string Option_c< OPTION_TX_BATCH_LATENCY >::doGetUsage() const
+{
+  return
+    "  --tx-batch-latency MSEC    Collect the messages for a client and send them\n"
+    "                             together once per loop, holding them back no longer\n"
+    "                             than MSEC (default 0: send each message immediately)\n";
+}
+
+template <>
+int Option_c< OPTION_BUS_TX_QUEUE_SIZE >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--bus-tx-queue-size")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    const int ci_size = atoi(argv[ai_pos+1]);
+    if (ci_size < 1) {
+      std::cerr << "error: bus TX queue size must be at least 1" << std::endl;
+      exit(1);
+    }
+    ar_server.mn_busTxQueueSize = ci_size;
+    return 2;
+  }
+  return 0;
+}
+
+template <>
+std::string Option_c< OPTION_BUS_TX_QUEUE_SIZE >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  ostr_setting << "TX queue size per bus: " << ar_server.mn_busTxQueueSize << " messages" << std::endl;
+  return ostr_setting.str();
+}
+
+template <>
+std::string Option_c< OPTION_BUS_TX_QUEUE_SIZE >::doGetUsage() const
+{
+  return
+    "  --bus-tx-queue-size SIZE   Number of messages buffered per bus while the CAN\n"
+    "                             device doesn't take them (default 256)\n";
+}
+
+template <>
+int Option_c< OPTION_BUS_TX_OVERFLOW >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--bus-tx-overflow")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    if (!strcmp(argv[ai_pos+1], sarr_txOverflowNames[__HAL::TX_OVERFLOW_DROP_NEWEST]))
+      ar_server.me_busTxOverflow = __HAL::TX_OVERFLOW_DROP_NEWEST;
+    else if (!strcmp(argv[ai_pos+1], sarr_txOverflowNames[__HAL::TX_OVERFLOW_DROP_OLDEST]))
+      ar_server.me_busTxOverflow = __HAL::TX_OVERFLOW_DROP_OLDEST;
+    else {
+      std::cerr << "error: unknown bus TX overflow policy " << argv[ai_pos+1] << std::endl;
+      exit(1);
+    }
+    return 2;
+  }
+  return 0;
+}
+
+template <>
+std::string Option_c< OPTION_BUS_TX_OVERFLOW >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  ostr_setting << "Bus TX queue overflow policy: " << sarr_txOverflowNames[ar_server.me_busTxOverflow] << std::endl;
+  return ostr_setting.str();
+}
+
+template <>
+std::string Option_c< OPTION_BUS_TX_OVERFLOW >::doGetUsage() const
+{
+  return
+    "  --bus-tx-overflow drop-newest|drop-oldest\n"
+    "                             What to do when a bus TX queue is full\n"
+    "                             (default drop-newest)\n";
+}
+
+template <>
+int Option_c< OPTION_TX_ARBITRATION >::doCheckAndHandle(int /*argc*/, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--tx-arbitration")) {
+    ar_server.mb_txArbitration = true;
+    return 1;
+  }
+  return 0;
+}
+
+template <>
+std::string Option_c< OPTION_TX_ARBITRATION >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  if (ar_server.mb_txArbitration) {
+    ostr_setting << "Sending the messages of a bus in arbitration order" << std::endl;
+  }
+  return ostr_setting.str();
+}
+
+template <>
+std::string Option_c< OPTION_TX_ARBITRATION >::doGetUsage() const
+{
+  return
+    "  --tx-arbitration           Send the messages of all clients for a bus in the\n"
+    "                             order of the CAN arbitration (lowest identifier\n"
+    "                             first) instead of the order they came in\n";
+}
+
+template <>
+int Option_c< OPTION_LATENCY_FILE >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--latency-file")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    ar_server.mstr_latencyFile = argv[ai_pos+1];
+    return 2;
+  }
+  return 0;
+}
+template <>
+std::string Option_c< OPTION_LATENCY_FILE >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  if (!ar_server.mstr_latencyFile.empty()) {
+    ostr_setting << "Writing latency histograms to " << ar_server.mstr_latencyFile << " on quit" << std::endl;
+  }
+  return ostr_setting.str();
+}
+template <>
+std::string Option_c< OPTION_LATENCY_FILE >::doGetUsage() const
+{
+  return
+    "  --latency-file FILE        Write the forwarding latency histograms to FILE\n"
+    "                             when quitting the server (interactive mode)\n";
+}
+
+template <>
+int Option_c< OPTION_METRICS_PORT >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--metrics-port")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    ar_server.mi_metricsPort = atoi(argv[ai_pos+1]);
+    if ((ar_server.mi_metricsPort <= 0) || (ar_server.mi_metricsPort > 0xFFFF)) {
+      std::cerr << "error: invalid metrics port " << argv[ai_pos+1] << std::endl;
+      exit(1);
+    }
+    return 2;
+  }
+  return 0;
+}
+template <>
+std::string Option_c< OPTION_METRICS_PORT >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  if (ar_server.mi_metricsPort > 0) {
+    ostr_setting << "Serving metrics on 127.0.0.1:" << ar_server.mi_metricsPort << std::endl;
+  }
+  return ostr_setting.str();
+}
+template <>
+std::string Option_c< OPTION_METRICS_PORT >::doGetUsage() const
+{
+  return
+    "  --metrics-port PORT        Serve the statistics in Prometheus text format\n"
+    "                             via HTTP on 127.0.0.1:PORT\n";
+}
+
+#ifndef WIN32
+template <>
+int Option_c< OPTION_METRICS_SOCKET >::doCheckAndHandle(int argc, char *argv[], int ai_pos, __HAL::server_c &ar_server) const
+{
+  if (!strcmp(argv[ai_pos], "--metrics-socket")) {
+    if (ai_pos+1>=argc) {
+      std::cerr << "error: option needs second parameter" << std::endl;
+      exit(1);
+    }
+    ar_server.mstr_metricsSocket = argv[ai_pos+1];
+    return 2;
+  }
+  return 0;
+}
+template <>
+std::string Option_c< OPTION_METRICS_SOCKET >::doGetSetting(__HAL::server_c &ar_server) const
+{
+  std::ostringstream ostr_setting;
+  if (!ar_server.mstr_metricsSocket.empty()) {
+    ostr_setting << "Serving metrics on " << ar_server.mstr_metricsSocket << std::endl;
+  }
+  return ostr_setting.str();
+}
+template <>
+std::string Option_c< OPTION_METRICS_SOCKET >::doGetUsage() const
+{
+  return
+    "  --metrics-socket PATH      Same as --metrics-port on the unix domain socket PATH\n";
+}
+#endif
+
 #ifndef WIN32
 /*  WIN32 Platforms can't handle the daemonize syscall. The service aequivalent is not supported by can_server */
 template <>
@@ -588,6 +1105,33 @@ std::string Option_c< OPTION_HELP >::doGetUsage() const
   return "  --help                     Print this help.\n";
 }
 
+// [usec] since 1970-01-01 UTC
+static int64_t wallClockTime()
+{
+#ifdef WIN32
+  FILETIME s_fileTime;
+  GetSystemTimeAsFileTime( &s_fileTime );
+  const uint64_t cui64_100ns = (uint64_t(s_fileTime.dwHighDateTime) << 32) | s_fileTime.dwLowDateTime;
+  return int64_t((cui64_100ns - 116444736000000000ULL) / 10);
+#else
+  struct timeval s_now;
+  gettimeofday( &s_now, NULL );
+  return int64_t(s_now.tv_sec) * 1000000 + s_now.tv_usec;
+#endif
+}
+
+static bool writeBinaryLogHeader( FILE *f_handle )
+{
+  canLogHeader_s s_header;
+  memset( &s_header, 0, sizeof(s_header) );
+  memcpy( s_header.arrc_magic, CAN_LOG_BINARY_MAGIC, sizeof(s_header.arrc_magic) );
+  s_header.ui16_version = CAN_LOG_BINARY_VERSION;
+  s_header.ui16_recordSize = sizeof(canLogRecord_s);
+  s_header.i64_startTime = __HAL::getTimeUsec();
+  s_header.i64_startTimeWallClock = wallClockTime();
+  return fwrite( &s_header, sizeof(s_header), 1, f_handle ) == 1;
+}
+
 /** Start a new file log.
  *  \return error.
  *  \retval true if an error occured.
@@ -599,8 +1143,10 @@ bool newFileLog(
 {
   std::ostringstream ostr_filename;
   ostr_filename << ap_server->mstr_logFileBase << "_" << std::hex << an_bus;
-  yasper::ptr< __HAL::LogFile_c > p_logFile = new __HAL::LogFile_c( ostr_filename.str() );
-  bool b_error = !p_logFile->getRaw();
+  const bool cb_binary = (ap_server->me_logFormat == CAN_LOG_FORMAT_BINARY);
+  pthread_mutex_lock( &ap_server->mt_protectLogFiles );
+  yasper::ptr< __HAL::LogFile_c > p_logFile = new __HAL::LogFile_c( ostr_filename.str(), cb_binary );
+  bool b_error = !p_logFile->getRaw() || (cb_binary && !writeBinaryLogHeader( p_logFile->getRaw() ));
   if (b_error) {
     if (ap_server->mb_interactive) {
       std::cerr << "Error: can not open log file " << ostr_filename.str() << "." << std::endl;
@@ -611,6 +1157,7 @@ bool newFileLog(
     }
     ap_server->canBus(an_bus).m_logFile = p_logFile;
   }
+  pthread_mutex_unlock( &ap_server->mt_protectLogFiles );
   return b_error;
 }
 
@@ -620,11 +1167,13 @@ void closeFileLog(
     __HAL::server_c *ap_server, /// server data
     size_t an_bus ) /// bus number
 {
+  pthread_mutex_lock( &ap_server->mt_protectLogFiles );
   ap_server->canBus(an_bus).m_logFile = __HAL::LogFile_c::Null_s()();
+  pthread_mutex_unlock( &ap_server->mt_protectLogFiles );
 }
 
 
-void dumpCanMsg (uint8_t bBusNumber, uint8_t bMsgObj, canMsg_s* ps_canMsg, FILE *f_handle)
+void dumpCanMsg (int64_t i64_time, uint8_t bBusNumber, uint8_t bMsgObj, canMsg_s* ps_canMsg, FILE *f_handle)
 {
   if( !can_filtering::pass(
         bBusNumber,
@@ -633,13 +1182,143 @@ void dumpCanMsg (uint8_t bBusNumber, uint8_t bMsgObj, canMsg_s* ps_canMsg, FILE
         ps_canMsg->ui8_data) )
     return;
 
-    fprintf(f_handle, "%10d %-2d %-2d %-2d %-2d %-2d %-8x  ",
-            __HAL::getTime(), bBusNumber, bMsgObj, ps_canMsg->i32_msgType, ps_canMsg->i32_len,
-            (ps_canMsg->ui32_id >> 26) & 7 /* priority */, ps_canMsg->ui32_id);
-    for (uint8_t ui8_i = 0; (ui8_i < ps_canMsg->i32_len) && (ui8_i < 8); ui8_i++)
-      fprintf(f_handle, " %-3hx", ps_canMsg->ui8_data[ui8_i]);
-    fprintf(f_handle, "\n");
-    fflush(f_handle);
+  canLogPrintText( f_handle, i64_time, bBusNumber, bMsgObj, *ps_canMsg );
+}
+
+static void dumpCanMsgBinary( __HAL::logRecord_s &ar_record, FILE *f_handle )
+{
+  canMsg_s &r_canMsg = ar_record.s_canMsg;
+  if( !can_filtering::pass(
+        ar_record.ui8_bus,
+        r_canMsg.ui32_id,
+        r_canMsg.i32_len,
+        r_canMsg.ui8_data) )
+    return;
+
+  canLogRecord_s s_logRecord;
+  s_logRecord.i64_time = ar_record.i64_time;
+  s_logRecord.ui32_id = r_canMsg.ui32_id;
+  s_logRecord.ui8_bus = ar_record.ui8_bus;
+  s_logRecord.ui8_obj = ar_record.ui8_obj;
+  s_logRecord.ui8_flags = r_canMsg.i32_msgType ? CAN_LOG_FLAG_XTD : 0;
+  s_logRecord.ui8_len = uint8_t(r_canMsg.i32_len);
+  memcpy( s_logRecord.arrui8_data, r_canMsg.ui8_data, sizeof(s_logRecord.arrui8_data) );
+  (void)fwrite( &s_logRecord, sizeof(s_logRecord), 1, f_handle );
+}
+
+static void flushLogFiles( __HAL::server_c *ap_server )
+{
+  pthread_mutex_lock( &ap_server->mt_protectLogFiles );
+  for (size_t n_bus = 0; n_bus < ap_server->nCanBusses(); ++n_bus) {
+    if (ap_server->canBus(n_bus).m_logFile)
+      fflush( ap_server->canBus(n_bus).m_logFile->getRaw() );
+  }
+  pthread_mutex_unlock( &ap_server->mt_protectLogFiles );
+}
+
+/** Log writer thread: writes the frames queued by dumpCanMsg() to the log
+ *  files, so that readWrite() never waits for the file system.
+ */
+static void *logWriter( void *ap_arg )
+{
+  __HAL::server_c *p_server = static_cast< __HAL::server_c * >(ap_arg);
+  __HAL::logQueue_s &r_queue = p_server->ms_logQueue;
+  const uint32_t cui32_size = uint32_t(r_queue.mvec_ring.size());
+  uint32_t ui32_droppedReported = 0;
+  int32_t i32_lastFlush = __HAL::getTime();
+  bool b_unflushed = false;
+
+  for (;;) {
+    const bool cb_stop = p_server->mb_logWriterStop;
+    const uint32_t cui32_head = __HAL::atomicLoadAcquire( &r_queue.mui32_head );
+    uint32_t ui32_tail = r_queue.mui32_tail;
+    const bool cb_idle = (ui32_tail == cui32_head);
+
+    if (!cb_idle) {
+      pthread_mutex_lock( &p_server->mt_protectLogFiles );
+      for (; ui32_tail != cui32_head; ++ui32_tail) {
+        __HAL::logRecord_s &r_record = r_queue.mvec_ring[ui32_tail % cui32_size];
+        // files are opened by newFileLog(), the bus may be closed (or the log off) meanwhile
+        if (!p_server->canBus(r_record.ui8_bus).m_logFile)
+          continue;
+
+        FILE *f_handle = p_server->canBus(r_record.ui8_bus).m_logFile->getRaw();
+        if (p_server->me_logFormat == CAN_LOG_FORMAT_BINARY)
+          dumpCanMsgBinary( r_record, f_handle );
+        else
+          dumpCanMsg( r_record.i64_time, r_record.ui8_bus, r_record.ui8_obj, &r_record.s_canMsg, f_handle );
+      }
+      pthread_mutex_unlock( &p_server->mt_protectLogFiles );
+      __HAL::atomicStoreRelease( &r_queue.mui32_tail, ui32_tail );
+      b_unflushed = true;
+    }
+
+    const uint32_t cui32_dropped = __HAL::atomicLoadAcquire( &r_queue.mui32_dropped );
+    if ((cui32_dropped != ui32_droppedReported) && p_server->mb_logMode) {
+      std::cerr << "Log queue overflow: " << (cui32_dropped - ui32_droppedReported) << " messages not logged." << std::endl;
+    }
+    ui32_droppedReported = cui32_dropped;
+
+    if (b_unflushed && (cb_stop || (__HAL::getTime() - i32_lastFlush >= CAN_SERVER_LOG_FLUSH_INTERVAL))) {
+      flushLogFiles( p_server );
+      i32_lastFlush = __HAL::getTime();
+      b_unflushed = false;
+    }
+
+    if (cb_stop)
+      return NULL;
+
+    if (cb_idle) {
+#ifdef WIN32
+      Sleep( 10 );
+#else
+      usleep( 10000 );
+#endif
+    }
+  }
+}
+
+void startLogWriter( __HAL::server_c *ap_server )
+{
+  if (ap_server->mb_logWriterRunning)
+    return;
+
+  ap_server->ms_logQueue.mvec_ring.resize( CAN_SERVER_LOG_QUEUE_SIZE );
+  if (pthread_create( &ap_server->mt_logWriter, NULL, &logWriter, ap_server )) {
+    std::cerr << "Could not create log writer thread!" << std::endl;
+    exit( 1 );
+  }
+  ap_server->mb_logWriterRunning = true;
+}
+
+// write what is queued and stop the log writer (at exit)
+void stopLogWriter( __HAL::server_c *ap_server )
+{
+  if (!ap_server->mb_logWriterRunning)
+    return;
+
+  ap_server->mb_logWriterStop = true;
+  pthread_join( ap_server->mt_logWriter, NULL );
+  ap_server->mb_logWriterRunning = false;
+}
+
+void openBus(uint8_t aui8_bus, uint32_t aui32_bitrate, __HAL::server_c* pc_serverData)
+{
+  // open log file only once per bus
+  if (pc_serverData->mb_logMode) {
+    newFileLog( pc_serverData, aui8_bus);
+  }
+
+  if (!openBusOnCard(aui8_bus,  // 0 for CANLPT/ICAN, else 1 for first BUS
+                     aui32_bitrate,
+                     pc_serverData))
+  {
+    std::cerr << "Can't initialize CAN-BUS." << std::endl;
+    std::cerr << "CAN device/driver not ready.\n" << std::endl;
+    exit(1);
+  }
+  pc_serverData->canBus(aui8_bus).mui32_bitrate = aui32_bitrate;
+  addCanDeviceToEventLoop(aui8_bus, pc_serverData);
 }
 
 void initialCanOpen(__HAL::server_c* pc_serverData)
@@ -648,19 +1327,134 @@ void initialCanOpen(__HAL::server_c* pc_serverData)
       iter != pc_serverData->m_l_initialOpenChannelData.end();
       ++iter)
   {
-    if (pc_serverData->mb_logMode) {
-      newFileLog( pc_serverData, iter->bus_number);
+    openBus(uint8_t(iter->bus_number), uint32_t(iter->baud_rate), pc_serverData);
+
+    pc_serverData->canBus(iter->bus_number).mui16_busRefCnt++;
+  }
+}
+
+size_t readFromBusBatchDefault(uint8_t ui8_bus, canMsg_s* ps_canMsgs, int64_t* pi64_rxTimes, size_t n_maxMsgs, __HAL::server_c* pc_serverData)
+{
+  size_t n_read = 0;
+  while ((n_read < n_maxMsgs) && readFromBus(ui8_bus, ps_canMsgs + n_read, pc_serverData))
+    pi64_rxTimes[n_read++] = CAN_SERVER_RX_TIME_NONE;
+  return n_read;
+}
+
+int64_t __HAL::rxTimeToServerTime(rxClockSync_s &ar_sync, int64_t ai64_deviceTime)
+{
+  const int64_t ci64_now = getTimeUsec();
+  const int64_t ci64_offset = ci64_now - ai64_deviceTime;
+
+  if (!ar_sync.mb_valid ||
+      (ci64_offset < ar_sync.mi64_offset - CAN_SERVER_RX_CLOCK_JUMP) ||
+      (ci64_offset > ar_sync.mi64_offset + CAN_SERVER_RX_CLOCK_JUMP))
+  {
+    ar_sync.mb_valid = true;
+    ar_sync.mi64_offset = ci64_offset;
+    ar_sync.mi64_windowMin = ci64_offset;
+    ar_sync.mi64_windowStart = ci64_now;
+  }
+  else
+  {
+    if (ci64_offset < ar_sync.mi64_offset)
+      ar_sync.mi64_offset = ci64_offset;
+    if (ci64_offset < ar_sync.mi64_windowMin)
+      ar_sync.mi64_windowMin = ci64_offset;
+    if (ci64_now - ar_sync.mi64_windowStart >= CAN_SERVER_RX_CLOCK_WINDOW)
+    { // the device clock may run slower than ours, so forget older minimums
+      ar_sync.mi64_offset = ar_sync.mi64_windowMin;
+      ar_sync.mi64_windowMin = ci64_offset;
+      ar_sync.mi64_windowStart = ci64_now;
     }
+  }
+
+  const int64_t ci64_time = ai64_deviceTime + ar_sync.mi64_offset;
+  return (ci64_time < ci64_now) ? ci64_time : ci64_now;
+}
+
+void __HAL::busLoad_s::advance(int64_t ai64_usec)
+{
+  const int64_t ci64_slot = ai64_usec / (1000 * CAN_SERVER_BUS_LOAD_SLOT);
+  if (ci64_slot <= mi64_slot)
+    return;
+  // clear the slots passed since the last frame
+  for (int64_t i64_slot = (std::max)(mi64_slot + 1, ci64_slot - CAN_SERVER_BUS_LOAD_SLOTS + 1); i64_slot <= ci64_slot; ++i64_slot)
+    marrui32_bits[i64_slot % CAN_SERVER_BUS_LOAD_SLOTS] = 0;
+  mi64_slot = ci64_slot;
+}
+
+
+uint32_t __HAL::busLoad_s::load(int64_t ai64_usec, busLoadWindow_e ae_window, uint32_t aui32_bitrate)
+{
+  if (!aui32_bitrate)
+    return 0;
+  advance(ai64_usec);
+
+  const int64_t ci64_slots = (ae_window == BUS_LOAD_100MS) ? 1 : (ae_window == BUS_LOAD_1S) ? 10 : 100;
+  uint64_t ui64_bits = 0;
+  for (int64_t i64_slot = (std::max)(mi64_slot - ci64_slots, int64_t(0)); i64_slot < mi64_slot; ++i64_slot)
+    ui64_bits += marrui32_bits[i64_slot % CAN_SERVER_BUS_LOAD_SLOTS];
+
+  // the window carries aui32_bitrate [kbit/s] * ci64_slots * CAN_SERVER_BUS_LOAD_SLOT [msec] bits
+  return uint32_t(ui64_bits * 10000 / (uint64_t(aui32_bitrate) * ci64_slots * CAN_SERVER_BUS_LOAD_SLOT));
+}
 
-    if (!openBusOnCard(iter->bus_number,
-                       iter->baud_rate,
-                       pc_serverData))
+
+uint32_t __HAL::latencyBucketHighest(size_t an_bucket)
+{
+  if (an_bucket < 2 * LATENCY_SUB_BUCKETS)
+    return uint32_t(an_bucket);
+  const size_t cn_shift = an_bucket / LATENCY_SUB_BUCKETS - 1;
+  const uint32_t cui32_lowest = uint32_t(an_bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS) << cn_shift;
+  return cui32_lowest + ((uint32_t(1) << cn_shift) - 1);
+}
+
+uint32_t __HAL::latencyHistogram_s::valueAtPercentile(double ad_percentile) const
+{
+  if (mui32_total == 0)
+    return 0;
+  // rank of the value, counted from 1
+  uint32_t ui32_rank = uint32_t(ad_percentile / 100.0 * mui32_total + 0.5);
+  if (ui32_rank < 1)
+    ui32_rank = 1;
+
+  uint32_t ui32_count = 0;
+  for (size_t n_bucket = 0; n_bucket < LATENCY_BUCKETS; ++n_bucket)
+  {
+    ui32_count += marrui32_count[n_bucket];
+    if (ui32_count >= ui32_rank)
+      return (std::min)(latencyBucketHighest(n_bucket), mui32_max);
+  }
+  return mui32_max;
+}
+
+void printLatency(FILE* ap_file, __HAL::server_c* pc_serverData, bool ab_buckets)
+{
+  static char const *const scarrc_names[__HAL::LATENCY_COUNT] = {
+    "bus->client", "client->client", "client->bus" };
+
+  fprintf(ap_file, "Latency [usec]    %10s %8s %8s %8s %8s %8s\n", "count", "p50", "p90", "p99", "p99.9", "max");
+  for (int i = 0; i < __HAL::LATENCY_COUNT; ++i)
+  {
+    const __HAL::latencyHistogram_s &r_histogram = pc_serverData->marrs_latency[i];
+    fprintf(ap_file, "  %-15s %10u %8u %8u %8u %8u %8u\n", scarrc_names[i], r_histogram.mui32_total,
+            r_histogram.valueAtPercentile(50.0), r_histogram.valueAtPercentile(90.0),
+            r_histogram.valueAtPercentile(99.0), r_histogram.valueAtPercentile(99.9), r_histogram.mui32_max);
+  }
+
+  if (!ab_buckets)
+    return;
+
+  // histograms as "highest value of the bucket, count" for plotting
+  for (int i = 0; i < __HAL::LATENCY_COUNT; ++i)
+  {
+    const __HAL::latencyHistogram_s &r_histogram = pc_serverData->marrs_latency[i];
+    fprintf(ap_file, "\n# %s\n", scarrc_names[i]);
+    for (size_t n_bucket = 0; n_bucket < LATENCY_BUCKETS; ++n_bucket)
     {
-      std::cerr << "Can't initialize CAN-BUS." << std::endl;
-      std::cerr << "CAN device/driver not ready.\n" << std::endl;
-      exit(1);
+      if (r_histogram.marrui32_count[n_bucket])
+        fprintf(ap_file, "%u %u\n", __HAL::latencyBucketHighest(n_bucket), r_histogram.marrui32_count[n_bucket]);
     }
-
-    pc_serverData->canBus(iter->bus_number).mui16_busRefCnt++;
   }
 }
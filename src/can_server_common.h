@@ -22,12 +22,14 @@
 #include <stdio.h>
 #include <string>
 #include <list>
+#include <map>
 
 #include "can_server_interface.h"
+#include "can_log_format.h"
 #include <yasper.h>
 
 #define MAJOR 2
-#define MINOR 1
+#define MINOR 2
 #define PATCH 0
 
 // Uncomment this define to substitute unavailable buses on the hardware by
@@ -35,10 +37,28 @@
 //#define DEFAULT_SUBSTITUTE_VIRTUAL
 #define HAL_CAN_MAX_BUS_NR 16
 
+// On Linux the main loop waits with epoll, where all sockets and CAN device
+// handles are registered once instead of rebuilding a select() set each turn.
+#ifndef WIN32
+  #define CAN_SERVER_USE_EPOLL
+#endif
+
+// Shared memory data path for local clients (see shmSegment_s), Linux only.
+#ifdef CAN_SERVER_USE_EPOLL
+  #define CAN_SERVER_USE_SHM
+#endif
+
 namespace __HAL {
 
 class server_c;
 
+// what to do when a client's TX queue is full
+enum TxOverflow_e {
+  TX_OVERFLOW_DROP_NEWEST,
+  TX_OVERFLOW_DROP_OLDEST,
+  TX_OVERFLOW_DISCONNECT
+};
+
 }
 
 void *readUserInput(void *ap_arg);
@@ -48,11 +68,38 @@ void usage();
 
 bool newFileLog( __HAL::server_c *p_server, size_t n_bus );
 void closeFileLog(__HAL::server_c *ap_server, size_t an_bus );
-void dumpCanMsg (uint8_t bBusNumber, uint8_t bMsgObj, canMsg_s* ps_canMsg, FILE *f_handle);
+void dumpCanMsg (int64_t i64_time, uint8_t bBusNumber, uint8_t bMsgObj, canMsg_s* ps_canMsg, FILE *f_handle);
+void startLogWriter( __HAL::server_c *ap_server );
+void stopLogWriter( __HAL::server_c *ap_server );
 
 namespace __HAL {
 
 
+// replay thread: max. frames handed over to readWrite() but not yet routed
+#define CAN_SERVER_REPLAY_MAX_PENDING 4096
+
+// log writer thread: queued frames, buffer per file and flush interval [msec]
+#define CAN_SERVER_LOG_QUEUE_SIZE     65536
+#define CAN_SERVER_LOG_FILE_BUFFER    (64 * 1024)
+#define CAN_SERVER_LOG_FLUSH_INTERVAL 100
+
+// frame handed from readWrite() to the log writer thread
+struct logRecord_s {
+  int64_t  i64_time; // [usec]
+  uint8_t  ui8_bus;
+  uint8_t  ui8_obj;
+  canMsg_s s_canMsg;
+};
+
+// single producer (readWrite()) / single consumer (log writer) queue
+struct logQueue_s {
+  std::vector<logRecord_s> mvec_ring; // allocated by startLogWriter()
+  volatile uint32_t mui32_head;       // written by readWrite() only
+  volatile uint32_t mui32_tail;       // written by the log writer only
+  volatile uint32_t mui32_dropped;    // written by readWrite() only
+  logQueue_s() : mvec_ring(), mui32_head(0), mui32_tail(0), mui32_dropped(0) {}
+};
+
 #if defined(_MSC_VER)
 #pragma warning( push )
 #pragma warning( disable : 4996 )
@@ -60,8 +107,12 @@ namespace __HAL {
 
 class LogFile_c {
 public:
-  LogFile_c ( std::string const &arstr_filename )
-    : mp_file( fopen( arstr_filename.c_str(), "a+" ) ) {}
+  LogFile_c ( std::string const &arstr_filename, bool ab_binary = false )
+    : mp_file( fopen( arstr_filename.c_str(), ab_binary ? "ab" : "a+" ) ) {
+    // flushed by the log writer thread, see CAN_SERVER_LOG_FLUSH_INTERVAL
+    if (mp_file)
+      setvbuf( mp_file, NULL, _IOFBF, CAN_SERVER_LOG_FILE_BUFFER );
+  }
   ~LogFile_c() {
     if (mp_file)
       fclose( mp_file );
@@ -86,6 +137,274 @@ private:
 #endif
 
 
+int32_t getTime();
+int64_t getTimeUsec(); // time base of getTime() in [usec]
+
+// Clock of the readWrite() thread: within a batch of frames (one device read,
+// one client recv(), one hand-over) the time is sampled once at its first use,
+// so the frames of a batch and all their receivers share one time stamp.
+// Outside of a batch every call samples the clock.
+class batchClock_c {
+public:
+  batchClock_c() : mb_inBatch(false), mi64_time(-1) {}
+  void beginBatch() { mb_inBatch = true; mi64_time = -1; }
+  void endBatch() { mb_inBatch = false; }
+  int64_t nowUsec() {
+    if (!mb_inBatch)
+      return getTimeUsec();
+    if (mi64_time < 0)
+      mi64_time = getTimeUsec();
+    return mi64_time;
+  }
+  int32_t nowMsec() { return int32_t(nowUsec() / 1000); }
+private:
+  bool    mb_inBatch;
+  int64_t mi64_time;
+};
+
+
+// Receive time stamps of a device clock [usec] are converted to the server
+// time base by an offset: the smallest difference seen between both clocks,
+// i.e. that of the frame read with the least delay. It's renewed every
+// CAN_SERVER_RX_CLOCK_WINDOW to follow the drift of the device clock and
+// reset on a jump (device clock restarted or wrapped around).
+#define CAN_SERVER_RX_CLOCK_WINDOW 10000000 // [usec]
+#define CAN_SERVER_RX_CLOCK_JUMP    1000000 // [usec]
+
+struct rxClockSync_s {
+  bool    mb_valid;
+  int64_t mi64_offset;      // server time - device time
+  int64_t mi64_windowMin;   // smallest offset in the current window
+  int64_t mi64_windowStart;
+  rxClockSync_s() : mb_valid(false), mi64_offset(0), mi64_windowMin(0), mi64_windowStart(0) {}
+};
+
+// server time [usec] of a device time stamp [usec] of a frame read just now
+int64_t rxTimeToServerTime(rxClockSync_s &ar_sync, int64_t ai64_deviceTime);
+
+
+// Routing index of one bus: the receiving message objects of all clients
+// grouped by their filter mask, so that an incoming identifier is looked up
+// once per distinct mask instead of being compared with every object.
+// A configuration change invalidates the index of its bus, which is then
+// rebuilt as a whole with the next frame: clients configure their objects
+// in bursts at start-up, so one rebuild covers them all.
+struct routeTarget_s {
+  client_c *mp_client;
+  uint8_t   mui8_obj;
+};
+
+struct routeMaskGroup_s {
+  bool     mb_xtd;
+  uint32_t mui32_mask;
+  // (filter & mask) => message objects
+  std::map< uint32_t, std::vector< routeTarget_s > > mmap_targets;
+};
+
+struct routingIndex_s {
+  std::vector< routeMaskGroup_s > mvec_groups;
+  bool mb_valid; // rebuilt on next use after a client's configuration changed
+  routingIndex_s() : mvec_groups(), mb_valid(false) {}
+};
+
+
+// Statistics of a bus, see COMMAND_STATS. Like the client statistics they are
+// counted by the readWrite() thread only and printed or reported by it, too.
+struct busStats_s {
+  uint32_t mui32_rxFrames;
+  uint32_t mui32_rxBytes;
+  uint32_t mui32_txFrames;
+  uint32_t mui32_txBytes;
+  uint32_t mui32_txErrors;
+  uint32_t mui32_txDropped;
+  uint32_t mui32_txLocal;  // not sent as only clients are addressed (--reduced-load-iso-bus-no)
+  uint32_t mui32_tpMessages;
+  uint32_t mui32_tpAborted;
+  busStats_s() : mui32_rxFrames(0), mui32_rxBytes(0), mui32_txFrames(0), mui32_txBytes(0), mui32_txErrors(0), mui32_txDropped(0), mui32_txLocal(0),
+                 mui32_tpMessages(0), mui32_tpAborted(0) {}
+};
+
+// A transport protocol transfer (TP or ETP) on a bus, reassembled while clients
+// subscribe to the messages (see COMMAND_TP_SUBSCRIBE). Sessions are keyed by
+// tpSessionKey() of the data frames; one without a frame for CAN_SERVER_TP_TIMEOUT
+// is dropped. ETP transfers above CAN_SERVER_TP_MAX_SIZE aren't reassembled.
+#define CAN_SERVER_TP_TIMEOUT  1250 // [msec], the longest of T1..T4
+#define CAN_SERVER_TP_MAX_SIZE (1024 * 1024) // [bytes]
+
+inline uint32_t tpSessionKey(bool ab_extended, uint8_t aui8_sa, uint8_t aui8_da)
+{
+  return (uint32_t(ab_extended) << 16) | (uint32_t(aui8_sa) << 8) | aui8_da;
+}
+
+struct tpSession_s {
+  uint32_t mui32_pgn;
+  uint8_t  mui8_priority;
+  std::vector<uint8_t> mvec_data;
+  std::vector<bool>    mvec_havePacket;
+  uint32_t mui32_missing;       // packets
+  uint32_t mui32_packetOffset;  // ETP: of the last DPO
+  int64_t  mi64_lastFrame;      // [usec]
+  client_c *mp_sender;          // NULL if from the bus
+};
+
+// Frames the CAN device did not accept at once (TX buffer full), retried by
+// drainBusTx() in each readWrite() pass. A frame not accepted within
+// CAN_SERVER_BUS_TX_TIMEOUT counts as TX error.
+// With --tx-arbitration all frames of a pass are queued and leave in the
+// order the bus arbitration would give them, else in the order they came.
+#define CAN_SERVER_BUS_TX_TIMEOUT 1000 // [msec]
+
+// the lower, the earlier the frame wins the arbitration: base identifier,
+// SRR/RTR (a data frame's RTR is dominant), IDE, extended identifier
+inline uint32_t canArbitrationKey(const canMsg_s &ar_canMsg)
+{
+  if (!ar_canMsg.i32_msgType)
+    return (ar_canMsg.ui32_id & 0x7FF) << 20;
+  return ((ar_canMsg.ui32_id & 0x1FFC0000) << 2) | (3 << 18) | (ar_canMsg.ui32_id & 0x3FFFF);
+}
+
+struct busTxQueue_s {
+  struct entry_s {
+    canMsg_s s_canMsg;
+    int64_t  i64_rxTime;  // for the latency
+    int64_t  i64_queued;  // [usec]
+    client_c *p_client;   // sender for its send delay, NULL for user messages
+    int32_t  i32_sendTimeStamp; // client time the client sent the frame, see transferBuf_s::s_data
+    uint16_t ui16_sendTimeStampHigh;
+    uint32_t ui32_arbitration; // canArbitrationKey() or 0 without --tx-arbitration
+    uint64_t ui64_seq;
+  };
+  // heap ordering for std::push_heap(), the next frame to send is at the front
+  struct sendsLater_s {
+    bool operator()(const entry_s &ar_a, const entry_s &ar_b) const {
+      return (ar_a.ui32_arbitration != ar_b.ui32_arbitration) ? (ar_a.ui32_arbitration > ar_b.ui32_arbitration) : (ar_a.ui64_seq > ar_b.ui64_seq);
+    }
+  };
+  std::vector<entry_s> mvec_heap;
+  uint64_t mui64_seq;
+  busTxQueue_s() : mvec_heap(), mui64_seq(0) {}
+  size_t size() const { return mvec_heap.size(); }
+};
+
+// Bus load from the frames the server receives and sends: the bits of each
+// frame (see canFrameBits()) are summed up in slots of CAN_SERVER_BUS_LOAD_SLOT,
+// a window is made up of the last completed slots.
+#define CAN_SERVER_BUS_LOAD_SLOT  100 // [msec]
+#define CAN_SERVER_BUS_LOAD_SLOTS 100
+
+enum busLoadWindow_e {
+  BUS_LOAD_100MS,
+  BUS_LOAD_1S,
+  BUS_LOAD_10S,
+  BUS_LOAD_WINDOWS
+};
+
+// bits on the wire with worst-case bit stuffing, including the interframe space
+inline uint32_t canFrameBits(const canMsg_s &ar_canMsg)
+{
+  // stuffing applies from SOF to the CRC: 34 bits (standard) or 54 (extended) + data
+  const uint32_t cui32_stuffed = (ar_canMsg.i32_msgType ? 54 : 34) + 8 * uint32_t(ar_canMsg.i32_len);
+  return cui32_stuffed + (cui32_stuffed - 1) / 4 + 13;
+}
+
+struct busLoad_s {
+  uint32_t marrui32_bits[CAN_SERVER_BUS_LOAD_SLOTS];
+  int64_t  mi64_slot; // number of the current slot (time / CAN_SERVER_BUS_LOAD_SLOT)
+  busLoad_s() : mi64_slot(0) { memset(marrui32_bits, 0, sizeof(marrui32_bits)); }
+  void add(int64_t ai64_usec, uint32_t aui32_bits) {
+    advance(ai64_usec);
+    marrui32_bits[mi64_slot % CAN_SERVER_BUS_LOAD_SLOTS] += aui32_bits;
+  }
+  void advance(int64_t ai64_usec);
+  // [0.01 %] at the bitrate [kbit/s], 0 if that's unknown
+  uint32_t load(int64_t ai64_usec, busLoadWindow_e ae_window, uint32_t aui32_bitrate);
+};
+
+// commands are counted by their COMMAND_xxx number, unknown ones in slot 0
+#define CAN_SERVER_STATS_COMMANDS 128
+
+
+// Forwarding latencies [usec] are collected in log-linear histograms (like
+// HdrHistogram): values below 2 * LATENCY_SUB_BUCKETS have a bucket each,
+// above that every power of two is split into LATENCY_SUB_BUCKETS buckets,
+// so a bucket is at most 1/32 (~3%) of its value wide. Values are capped at
+// 2^31-1 usec.
+#define LATENCY_SUB_BITS    5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS     ((32 - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS)
+
+enum latency_e {
+  LATENCY_RX_TO_CLIENT,     // frame read from the bus => sent to a client
+  LATENCY_CLIENT_TO_CLIENT, // frame received from a client => sent to another one
+  LATENCY_CLIENT_TO_BUS,    // frame received from a client => sendToBus() returned
+  LATENCY_COUNT
+};
+
+inline size_t latencyBucket(uint32_t aui32_usec)
+{
+  if (aui32_usec < 2 * LATENCY_SUB_BUCKETS)
+    return aui32_usec;
+#if defined(__GNUC__)
+  const int ci_highestBit = 31 - __builtin_clz(aui32_usec);
+#else
+  int ci_highestBit = 2 * LATENCY_SUB_BITS;
+  while (aui32_usec >> (ci_highestBit + 1))
+    ++ci_highestBit;
+#endif
+  const int ci_shift = ci_highestBit - LATENCY_SUB_BITS;
+  return size_t(ci_shift + 1) * LATENCY_SUB_BUCKETS + (aui32_usec >> ci_shift) - LATENCY_SUB_BUCKETS;
+}
+
+// recorded and read by the readWrite() thread only
+struct latencyHistogram_s {
+  uint32_t marrui32_count[LATENCY_BUCKETS];
+  uint32_t mui32_total;
+  uint32_t mui32_max;
+  uint64_t mui64_sum;
+  latencyHistogram_s() { reset(); }
+  void reset() { memset(this, 0, sizeof(*this)); }
+  void record(int64_t ai64_usec) {
+    const uint32_t cui32_usec = (ai64_usec <= 0) ? 0 : (ai64_usec >= 0x7FFFFFFF) ? 0x7FFFFFFF : uint32_t(ai64_usec);
+    ++marrui32_count[latencyBucket(cui32_usec)];
+    ++mui32_total;
+    mui64_sum += cui32_usec;
+    if (cui32_usec > mui32_max)
+      mui32_max = cui32_usec;
+  }
+  // highest value of the bucket the percentile falls into
+  uint32_t valueAtPercentile(double ad_percentile) const;
+};
+uint32_t latencyBucketHighest(size_t an_bucket);
+
+
+// Copy of the statistics for the metrics thread (--metrics-port), taken by
+// readWrite() on request, so that the thread can format them at its own pace.
+struct metricsSnapshot_s {
+  struct bus_s {
+    bool       mb_open;
+    busStats_s ms_stats;
+    uint32_t   marrui32_load[BUS_LOAD_WINDOWS];
+    uint32_t   mui32_txQueued;
+  };
+  struct client_s {
+    bool     mb_shm;
+    uint32_t mui32_rxFrames;
+    uint32_t mui32_delivered;
+    uint32_t mui32_dropped;
+    uint32_t mui32_queued;
+    uint32_t mui32_sendErrors;
+  };
+  std::vector<bus_s>    mvec_busses;
+  std::vector<client_s> mvec_clients;
+  uint32_t marrui32_commandCount[CAN_SERVER_STATS_COMMANDS];
+  latencyHistogram_s marrs_latency[LATENCY_COUNT];
+  uint32_t mui32_logDropped;
+  metricsSnapshot_s() : mvec_busses(), mvec_clients(), mui32_logDropped(0) {
+    memset(marrui32_commandCount, 0, sizeof(marrui32_commandCount));
+  }
+};
+
+
 // server specific data
 class server_c {
 public:
@@ -110,11 +429,25 @@ public:
   std::string mstr_inputFile;
   // logging
   bool     mb_logMode;
+  CanLogFormat_e me_logFormat;
+  logQueue_s ms_logQueue;
+  // log files are written by the log writer thread, opened/closed by the others
+  pthread_mutex_t mt_protectLogFiles;
+  pthread_t mt_logWriter;
+  bool     mb_logWriterRunning;
+  volatile bool mb_logWriterStop;
   // monitor
   bool     mb_monitorMode;
+  // time of the last bus load shown in monitor mode [usec]
+  int64_t  mi64_monitorBusLoad;
   // replay
   bool     mb_inputFileMode;
   FILE*    mf_canInput;
+  double   md_replaySpeed; // 0 => as fast as possible
+  bool     mb_replayLoop;
+  uint8_t  marrui8_replayBusMap[HAL_CAN_MAX_BUS_NR];
+  // set by readWrite() when the first client opens a bus, the replay starts then
+  volatile bool mb_replayStart;
   // initial CAN open
   std::list<InitialOpenChannelData> m_l_initialOpenChannelData;
   // replace non-existing physical CAN devices with a virtual substitute
@@ -125,26 +458,97 @@ public:
   bool     mb_daemon;
 #endif
 
+  // ISOBUS source addresses on bus mi16_reducedLoadOnIsoBus: seen from the
+  // physical bus, and claimed by a client (its owner, NULL if none)
   bool     marrb_remoteDestinationAddressInUse[0x100];
+  client_c *marrp_localAddressOwner[0x100];
 
 #ifdef CAN_DRIVER_MESSAGE_QUEUE
   int32_t  mi32_lastPipeId;
   int32_t  marri32_fileDescrWakeUpPipeForNewBusEvent[2];
 #endif
 
-  // if >0 => do not send messages with local destination address on the bus
+  // if >=0 => do not send messages with local destination address on the bus
   int16_t  mi16_reducedLoadOnIsoBus;
 
-  pthread_mutex_t mt_protectClientList;
+  // per client TX queue (records) and its overflow handling
+  size_t   mn_clientTxQueueSize;
+  TxOverflow_e me_clientTxOverflow;
+  // per bus TX queue (frames) and its overflow handling (no disconnect)
+  size_t   mn_busTxQueueSize;
+  TxOverflow_e me_busTxOverflow;
+  // send the frames of a bus in arbitration order, see busTxQueue_s
+  bool     mb_txArbitration;
+  // stamp of the frame currently routed, see client_c::mui32_routeStamp
+  uint32_t mui32_routeStamp;
+  std::vector<client_c*> mvec_routeReceivers;
+
+  // clients with mb_disconnect set, to be released by readWrite()
+  uint32_t mui32_clientsToDisconnect;
+  // >0 => collect the frames for a client during a readWrite() pass and send them
+  // with one call at its end, but hold them back no longer than this [msec]
+  int32_t  mi32_txBatchLatency;
+  std::vector<client_c*> mvec_clientsToFlush;
+  int32_t  mi32_txBatchStart;
+
+  // commands received, see CAN_SERVER_STATS_COMMANDS
+  uint32_t marrui32_commandCount[CAN_SERVER_STATS_COMMANDS];
+  latencyHistogram_s marrs_latency[LATENCY_COUNT];
+  // histograms written on "quit" (--latency-file)
+  std::string mstr_latencyFile;
+
+  // metrics endpoint, off if neither is set
+  int      mi_metricsPort;
+#ifndef WIN32
+  std::string mstr_metricsSocket;
+#endif
+  // written by readWrite() on REQUEST_METRICS, which only tries to lock it
+  pthread_mutex_t mt_protectMetrics;
+  metricsSnapshot_s ms_metrics;
+
+  // mlist_clients, the routing indices and the CAN devices are only touched by
+  // the readWrite() thread; other threads hand over new clients and user
+  // messages, which readWrite() takes over at the start of each pass
+  pthread_mutex_t mt_protectHandOver;
+  std::list<client_c> mlist_newClients;
+  std::vector<transferBuf_s> mvec_userMsgs;
+  std::vector<transferBuf_s> mvec_replayMsgs;
+  // REQUEST_xxx of the interactive commands and the metrics thread, done by readWrite()
+  uint32_t mui32_requests;
+  // time stamps of the frames handled by readWrite()
+  batchClock_c mc_batchClock;
+#ifdef CAN_SERVER_USE_SHM
+  // id of the next shared memory segment, part of its name
+  int32_t  mi32_nextShmId;
+#endif
+#ifdef CAN_SERVER_USE_EPOLL
+  int      mi_epollFd;
+  // eventfd to wake up readWrite() which otherwise blocks until a socket or device is ready
+  int      mi_wakeUpFd;
+  // lookup of the client owning a ready socket
+  std::map< SOCKET_TYPE, std::list<client_c>::iterator > mmap_clientBySocket;
+#endif
   bool     mb_interactive;
   int      mi_canReadNiceValue;
 
   struct canBus_s {
     uint16_t                 mui16_globalMask;
     int32_t                  mi32_can_device;
+#ifdef CAN_SERVER_USE_EPOLL
+    int32_t                  mi32_can_deviceInEventLoop;
+#endif
     int32_t                  mi32_sendDelay;
     uint16_t                 mui16_busRefCnt;
     yasper::ptr< LogFile_c > m_logFile;
+    routingIndex_s           ms_routing;
+    busStats_s               ms_stats;
+    // of the INIT that opened the bus [kbit/s]
+    uint32_t                 mui32_bitrate;
+    busLoad_s                ms_load;
+    busTxQueue_s             ms_txQueue;
+    // clients subscribed to reassembled messages, sessions are tracked only then
+    uint16_t                 mui16_tpSubscribers;
+    std::map< uint32_t, tpSession_s > mmap_tpSessions;
     canBus_s();
   };
   canBus_s &canBus(size_t n_index);
@@ -154,10 +558,9 @@ private:
   std::vector< canBus_s > mvec_canBus;
 };
 
+// busses 0..HAL_CAN_MAX_BUS_NR, never reallocated as the log writer thread reads them, too
 inline server_c::canBus_s &server_c::canBus(size_t n_index)
 {
-  if (mvec_canBus.size() <= n_index)
-    mvec_canBus.resize(n_index + 1);
   return mvec_canBus[n_index];
 }
 
@@ -166,8 +569,6 @@ inline size_t server_c::nCanBusses()
   return mvec_canBus.size();
 }
 
-int32_t getTime();
-
 } //namespace __HAL
 
 class AOption_c {
@@ -188,13 +589,28 @@ private:
  * values for Option_c (which is defined below). */
 enum OPTION_MONITOR {};
 enum OPTION_LOG {};
+enum OPTION_LOG_FORMAT {};
 enum OPTION_FILE_INPUT {};
+enum OPTION_REPLAY_SPEED {};
+enum OPTION_REPLAY_LOOP {};
+enum OPTION_REPLAY_BUS_MAP {};
 enum OPTION_REDUCED_LOAD_ISO_BUS_NO {};
 enum OPTION_NICE_CAN_READ {};
 enum OPTION_INTERACTIVE {};
 enum OPTION_PRODUCTIVE {};
 enum OPTION_INITIAL_CAN_OPEN {};
 enum OPTION_VIRTUAL_CAN_SUBSTITUTE {};
+enum OPTION_TX_QUEUE_SIZE {};
+enum OPTION_TX_OVERFLOW {};
+enum OPTION_TX_BATCH_LATENCY {};
+enum OPTION_BUS_TX_QUEUE_SIZE {};
+enum OPTION_BUS_TX_OVERFLOW {};
+enum OPTION_TX_ARBITRATION {};
+enum OPTION_LATENCY_FILE {};
+enum OPTION_METRICS_PORT {};
+#ifndef WIN32
+enum OPTION_METRICS_SOCKET {};
+#endif
 #ifndef WIN32
 enum OPTION_DAEMON {};
 #endif
@@ -229,11 +645,43 @@ void     closeBusOnCard(uint8_t ui8_bus, __HAL::server_c* pc_serverData);
 
 int16_t  sendToBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, __HAL::server_c* pc_serverData);
 bool     readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, __HAL::server_c* pc_serverData);
+// read up to n_maxMsgs messages at once, returns the number of messages read (0 if none pending);
+// pi64_rxTimes gets the receive time stamp of each message from the device (see rxTimeToServerTime())
+// or CAN_SERVER_RX_TIME_NONE
+size_t   readFromBusBatch(uint8_t ui8_bus, canMsg_s* ps_canMsgs, int64_t* pi64_rxTimes, size_t n_maxMsgs, __HAL::server_c* pc_serverData);
+// readFromBusBatch() for drivers without bulk read and time stamps: calls readFromBus() repeatedly
+size_t   readFromBusBatchDefault(uint8_t ui8_bus, canMsg_s* ps_canMsgs, int64_t* pi64_rxTimes, size_t n_maxMsgs, __HAL::server_c* pc_serverData);
+#define CAN_SERVER_RX_TIME_NONE (-1)
 
 bool     isBusOpen(uint8_t ui8_bus);
 
 void sendUserMsg(uint32_t DLC, uint32_t ui32_id, uint32_t ui32_bus, uint8_t ui8_xtd, uint8_t* pui8_data, __HAL::server_c* pc_serverData);
-
+// requests of other threads, which readWrite() has to do as only it may touch the data
+#define REQUEST_STATS         0x1
+#define REQUEST_LATENCY       0x2
+#define REQUEST_LATENCY_RESET 0x4
+#define REQUEST_LATENCY_FILE  0x8
+#define REQUEST_METRICS       0x10 // fill server_c::ms_metrics
+// ab_wait: return not before readWrite() has done the request (or after 2 s)
+void handOverRequest(uint32_t aui32_request, __HAL::server_c* pc_serverData, bool ab_wait = false);
+void printLatency(FILE* ap_file, __HAL::server_c* pc_serverData, bool ab_buckets);
+const char* commandName(uint16_t ui16_command);
+
+// metrics endpoint (--metrics-port, --metrics-socket) served by a thread of its own
+void startMetrics(__HAL::server_c* pc_serverData);
+
+// first open of a bus (log file, CAN device, bitrate for the bus load), exits on failure
+void openBus(uint8_t aui8_bus, uint32_t aui32_bitrate, __HAL::server_c* pc_serverData);
 void initialCanOpen(__HAL::server_c* pc_serverData);
 
+// replay of a recorded log (--file-input) by a thread of its own
+void startReplay(__HAL::server_c* pc_serverData);
+// hands the frames over to readWrite(), returns the number of frames not yet routed
+size_t handOverReplayMsgs(std::vector<__HAL::transferBuf_s>& arvec_msgs, __HAL::server_c* pc_serverData);
+
+void wakeUpReadWrite(__HAL::server_c* pc_serverData);
+void flushPendingClients(__HAL::server_c* pc_serverData);
+void addCanDeviceToEventLoop(uint8_t ui8_bus, __HAL::server_c* pc_serverData);
+void removeCanDeviceFromEventLoop(uint8_t ui8_bus, __HAL::server_c* pc_serverData);
+
 #endif //ndef _CAN_SERVER_COMMON_H_
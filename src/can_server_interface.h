@@ -88,11 +88,63 @@ typedef int32_t ecutime_t;
 #define COMMAND_CLOSEOBJ        50
 #define COMMAND_SEND_DELAY      60
 #define COMMAND_DATA            70
+#define COMMAND_SHM_DOORBELL    71
+#define COMMAND_TP_DATA         72
+#define COMMAND_STATS           80
+#define COMMAND_TP_SUBSCRIBE    81
+#define COMMAND_TP_UNSUBSCRIBE  82
 
 #define ACKNOWLEDGE_DATA_CONTENT_ERROR_VALUE 0
 #define ACKNOWLEDGE_DATA_CONTENT_PIPE_ID     1
 #define ACKNOWLEDGE_DATA_CONTENT_SEND_DELAY  2
 #define ACKNOWLEDGE_DATA_CONTENT_QUERY_LOCK  3
+#define ACKNOWLEDGE_DATA_CONTENT_SHM_ID      4
+#define ACKNOWLEDGE_DATA_CONTENT_STATS       5
+
+// flags in s_startTimeClock.i32_fill1 of COMMAND_REGISTER (old servers ignore them),
+// the server returns the flags it accepted in s_acknowledge.i32_registerFlags
+#define REGISTER_FLAG_SHARED_MEMORY 0x1
+// s_data time stamps to the client in [usec], see transferBuf_s::s_data
+#define REGISTER_FLAG_TIME_USEC     0x2
+
+// COMMAND_STATS queries one counter: STATS_xxx in s_config.ui32_dwId, the bus
+// in s_config.ui8_bus, the client (index of the connected clients, 0xFF for the
+// requesting one) or the COMMAND_xxx in s_config.ui8_obj. The ACK has
+// ACKNOWLEDGE_DATA_CONTENT_STATS and the value in i32_data, counters wrap around at 2^32.
+#define STATS_CLIENTS              1  // number of connected clients
+#define STATS_LOG_DROPPED          2  // frames the log writer couldn't keep up with
+#define STATS_COMMANDS             3  // commands of type s_config.ui8_obj received
+#define STATS_BUS_RX_FRAMES        10
+#define STATS_BUS_RX_BYTES         11
+#define STATS_BUS_TX_FRAMES        12
+#define STATS_BUS_TX_BYTES         13
+#define STATS_BUS_TX_ERRORS        14 // the CAN device did not take the frame within 1 s
+#define STATS_BUS_LOAD_100MS       15 // bus load [0.01 %] of the last 100 msec,
+#define STATS_BUS_LOAD_1S          16 // ... second
+#define STATS_BUS_LOAD_10S         17 // ... 10 seconds (0 before the bus is opened)
+#define STATS_BUS_TX_QUEUED        18 // frames waiting for the CAN device now
+#define STATS_BUS_TX_DROPPED       19 // ... dropped on TX queue overflow
+#define STATS_CLIENT_RX_FRAMES     20 // COMMAND_DATA from the client
+#define STATS_CLIENT_DELIVERED     21 // frames queued to the client
+#define STATS_CLIENT_DROPPED       22 // ... dropped on TX queue overflow
+#define STATS_CLIENT_QUEUED        23 // ... waiting in the TX queue now
+#define STATS_CLIENT_SEND_ERRORS   24 // send() to the client failed
+#define STATS_BUS_TP_MESSAGES      30 // transport protocol messages reassembled
+#define STATS_BUS_TP_ABORTED       31 // ... aborted or timed out
+
+/* Reassembled ISOBUS transport protocol messages (TP and ETP, ISO 11783-3)
+ *
+ * COMMAND_TP_SUBSCRIBE with the PGN in s_config.ui32_dwId (TP_PGN_ALL for all)
+ * and the bus in s_config.ui8_bus. While a bus has subscribers, the server
+ * reassembles the BAM and RTS/CTS transfers seen on it (from the bus and from
+ * the clients) and sends each complete message to the subscribers except its
+ * sender: a COMMAND_TP_DATA record (s_tpMessage) on the data socket, followed
+ * by the payload in ceil(ui32_size / sizeof(transferBuf_s)) raw records, the
+ * last one padded with zeros. The frames keep being delivered as configured.
+ * These messages always use the data socket, also with the shared memory path.
+ * COMMAND_TP_UNSUBSCRIBE removes the PGN, or with TP_PGN_ALL all of the bus.
+ */
+#define TP_PGN_ALL 0xFFFFFFFF
 
 // msq specific defines
 #define MTYPE_ANY               0x0
@@ -241,7 +293,7 @@ struct transferBuf_s {
     struct {
       int32_t i32_dataContent; // set to DATA_CONTENT_xxx
       int32_t i32_data; // depends on dataContent
-      int32_t i32_fill2;
+      int32_t i32_registerFlags; // ACK of COMMAND_REGISTER: accepted REGISTER_FLAG_xxx
       int32_t i32_fill3;
     } s_acknowledge;
     struct {
@@ -271,18 +323,76 @@ struct transferBuf_s {
       uint16_t ui16_wBitrate;
       uint16_t ui16_fill2;
     } s_init;
+    /* The time stamp of a message to the client is in [msec] client time,
+     * that of a message from the client (its send time, for COMMAND_SEND_DELAY)
+     * as well. With REGISTER_FLAG_TIME_USEC both are in [usec] instead, 48 bit wide:
+     * (int64_t(ui16_sendTimeStampHigh) << 32) | uint32_t(i32_sendTimeStamp) */
     struct {
       struct canMsg_s s_canMsg;
       uint8_t  ui8_bus;
       uint8_t  ui8_obj;
+      uint16_t ui16_sendTimeStampHigh; // was padding, 0 from old servers/clients
       ecutime_t  i32_sendTimeStamp;
     } s_data;
+    // COMMAND_TP_DATA, time stamp of the frame completing the message as in s_data
+    struct {
+      uint32_t ui32_pgn;
+      uint32_t ui32_size; // [bytes]
+      uint8_t  ui8_bus;
+      uint8_t  ui8_sa;
+      uint8_t  ui8_da;    // 0xFF for a broadcast (BAM)
+      uint8_t  ui8_priority;
+      uint16_t ui16_sendTimeStampHigh;
+      uint16_t ui16_fill;
+      ecutime_t  i32_sendTimeStamp;
+    } s_tpMessage;
   };
   transferBuf_s() {
     memset(this, 0, sizeof *this);
   }
 };
 
+/* Shared memory data path (Linux) for clients on the same host
+ *
+ * A client sets REGISTER_FLAG_SHARED_MEMORY in COMMAND_REGISTER. If the server
+ * supports it, the ACK has ACKNOWLEDGE_DATA_CONTENT_SHM_ID instead of _PIPE_ID,
+ * and the client maps the shmSegment_s "CAN_SERVER_SHM_NAME<command port>.<id>"
+ * (shm_open()). COMMAND_DATA records then go through the two rings instead of
+ * the data socket; the sockets stay connected (commands, doorbell).
+ *
+ * Each ring has one producer and one consumer. Indices are free running and
+ * taken modulo CAN_SERVER_SHM_RING_SIZE; the producer writes the record before
+ * ui32_head (release), the consumer reads it before ui32_tail (release).
+ * A consumer about to sleep sets ui32_consumerWaiting = 1, then (full barrier)
+ * checks the ring once more. A producer which, after its push (full barrier),
+ * swaps ui32_consumerWaiting from 1 to 0 has to wake up the consumer:
+ *  - server => client: FUTEX_WAKE on s_toClient.ui32_head
+ *  - client => server: COMMAND_SHM_DOORBELL record on the data socket
+ */
+#define CAN_SERVER_SHM_NAME      "/can_server_shm."
+#define CAN_SERVER_SHM_MAGIC     0x43534831 // "CSH1"
+#define CAN_SERVER_SHM_RING_SIZE 1024 // records, power of two
+
+struct shmRing_s {
+  volatile uint32_t ui32_head; // written by producer only
+  uint8_t           ui8_fill1[60];
+  volatile uint32_t ui32_tail; // written by consumer only
+  volatile uint32_t ui32_consumerWaiting;
+  uint8_t           ui8_fill2[56];
+  transferBuf_s     arrs_records[CAN_SERVER_SHM_RING_SIZE];
+};
+
+struct shmSegment_s {
+  uint32_t  ui32_magic;
+  uint32_t  ui32_ringSize;
+  uint8_t   ui8_fill[56];
+  shmRing_s s_toClient;
+  shmRing_s s_toServer;
+};
+
+// received bytes per socket, drained with one recv() and then parsed as transferBuf_s records
+#define CLIENT_RX_BUFFER_SIZE (32 * sizeof(transferBuf_s))
+
 // client specific data
 struct client_c
 {
@@ -292,8 +402,58 @@ public:
   SOCKET_TYPE  i32_commandSocket;
   SOCKET_TYPE  i32_dataSocket;
 
+  struct rxBuffer_s {
+    char   arrc_data[CLIENT_RX_BUFFER_SIZE];
+    size_t n_fill; // bytes of an incomplete transferBuf_s are kept for the next recv()
+    rxBuffer_s() : n_fill(0) {}
+  };
+  rxBuffer_s ms_commandRx;
+  rxBuffer_s ms_dataRx;
+
+  // frames for the data socket which couldn't be sent yet (bounded ring buffer)
+  struct txQueue_s {
+    std::vector<transferBuf_s> mvec_ring;
+    size_t                     mn_head;
+    size_t                     mn_count;
+    size_t                     mn_headBytesSent; // head record may be sent partially
+    uint32_t                   mui32_dropped;
+    bool                       mb_waitWritable;
+    // receive time of the queued frames for the latency histograms
+    struct stamp_s {
+      int64_t i64_rxTime; // [usec]
+      uint8_t ui8_latency; // LATENCY_xxx
+      bool    b_tpMessage; // record of a COMMAND_TP_DATA message: no latency, not dropped alone
+    };
+    std::vector<stamp_s>       mvec_stamp; // parallel to mvec_ring
+    txQueue_s();
+  };
+  txQueue_s ms_txQueue;
+  // queued frames are held back until the end of the readWrite() pass (see --tx-batch-latency)
+  bool      mb_flushPending;
+  // set on TX queue overflow with policy "disconnect", client is released by readWrite()
+  bool      mb_disconnect;
+
+  // mapped shared memory data path, NULL when the data socket is used
+  shmSegment_s *mp_shm;
+  int32_t       mi32_shmId;
+
+  // routing of one frame: frame stamp and lowest matching message object
+  uint32_t  mui32_routeStamp;
+  uint8_t   mui8_routeObj;
+
   uint16_t ui16_pid;
   int32_t  i32_msecStartDeltaClientMinusServer;
+  // REGISTER_FLAG_TIME_USEC
+  bool     mb_timeUsec;
+
+  // statistics, see COMMAND_STATS (dropped frames: ms_txQueue.mui32_dropped)
+  struct stats_s {
+    uint32_t mui32_rxFrames;
+    uint32_t mui32_delivered;
+    uint32_t mui32_sendErrors;
+    stats_s() : mui32_rxFrames(0), mui32_delivered(0), mui32_sendErrors(0) {}
+  };
+  stats_s  ms_stats;
 
 
   struct canBus_s {
@@ -302,8 +462,11 @@ public:
     uint16_t                mui16_globalMask;
     uint32_t                mui32_globalMask;
     uint32_t                mui32_lastMask;
+    // largest [msec] from the client's send time stamp to sendToBus(), negated once reported
     int32_t                 mi32_sendDelay;
     bool                    mb_initReceived;
+    // PGNs of COMMAND_TP_SUBSCRIBE (or TP_PGN_ALL)
+    std::vector<uint32_t>   mvec_tpPgns;
     canBus_s();
   };
   canBus_s &canBus(size_t n_index);
@@ -0,0 +1,316 @@
+/*
+  can_server_metrics.cpp: Statistics in Prometheus text format via HTTP
+    (--metrics-port, --metrics-socket)
+
+  (C) Copyright 2009 - 2022 by OSB connagtive GmbH
+
+  Use, modification and distribution are subject to the GNU General
+  Public License, see accompanying file LICENSE.txt
+*/
+
+#include "can_server_common.h"
+
+#include <iostream>
+#include <sstream>
+
+#ifdef WIN32
+  #ifndef WINCE
+    #include <ws2tcpip.h>
+  #endif
+#else
+  #include <unistd.h>
+  #include <sys/types.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+  #include <sys/time.h>
+  #include <sys/resource.h>
+  #include <sys/syscall.h>
+  #include <netinet/in.h>
+  #include <arpa/inet.h>
+#endif
+
+#if defined(_MSC_VER)
+#pragma warning( disable : 4996 )
+#endif
+
+namespace {
+
+// time a scraper gets to send its request [msec]
+const int sci_requestTimeout = 2000;
+
+const char *const scarrpc_latencyPath[__HAL::LATENCY_COUNT] = { "bus_to_client", "client_to_client", "client_to_bus" };
+const double scarrd_quantile[] = { 0.5, 0.9, 0.99, 0.999 };
+const char *const scarrpc_busLoadWindow[__HAL::BUS_LOAD_WINDOWS] = { "100ms", "1s", "10s" };
+
+void closeSocket(SOCKET_TYPE a_socket)
+{
+#ifdef WIN32
+  closesocket(a_socket);
+#else
+  close(a_socket);
+#endif
+}
+
+SOCKET_TYPE listenTcp(int ai_port)
+{
+  SOCKET_TYPE listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listenSocket == INVALID_SOCKET)
+    return INVALID_SOCKET;
+
+  int i_reuse = 1;
+  (void)setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&i_reuse, sizeof(i_reuse));
+
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+  sa.sin_port = htons((unsigned short)ai_port);
+  if ((bind(listenSocket, (struct sockaddr *)&sa, sizeof(sa)) < 0) || (listen(listenSocket, 4) < 0)) {
+    closeSocket(listenSocket);
+    return INVALID_SOCKET;
+  }
+  return listenSocket;
+}
+
+#ifndef WIN32
+SOCKET_TYPE listenUnix(const std::string &astr_path)
+{
+  struct sockaddr_un sa;
+  if (astr_path.size() >= sizeof(sa.sun_path))
+    return INVALID_SOCKET;
+
+  SOCKET_TYPE listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenSocket == INVALID_SOCKET)
+    return INVALID_SOCKET;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, astr_path.c_str());
+  unlink(sa.sun_path);
+  if ((bind(listenSocket, (struct sockaddr *)&sa, sizeof(sa)) < 0) || (listen(listenSocket, 4) < 0)) {
+    closeSocket(listenSocket);
+    return INVALID_SOCKET;
+  }
+  return listenSocket;
+}
+#endif
+
+// wait for ai_msec at most, true if a_socket is readable
+bool waitReadable(SOCKET_TYPE a_socket, int ai_msec)
+{
+  fd_set readSet;
+  FD_ZERO(&readSet);
+  FD_SET(a_socket, &readSet);
+  struct timeval s_timeout;
+  s_timeout.tv_sec = ai_msec / 1000;
+  s_timeout.tv_usec = (ai_msec % 1000) * 1000;
+  return select(int(a_socket) + 1, &readSet, NULL, NULL, &s_timeout) > 0;
+}
+
+void counter(std::ostringstream &ar_out, const char *apc_name, const char *apc_help)
+{
+  ar_out << "# HELP " << apc_name << " " << apc_help << "\n"
+         << "# TYPE " << apc_name << " counter\n";
+}
+
+void gauge(std::ostringstream &ar_out, const char *apc_name, const char *apc_help)
+{
+  ar_out << "# HELP " << apc_name << " " << apc_help << "\n"
+         << "# TYPE " << apc_name << " gauge\n";
+}
+
+std::string render(const __HAL::metricsSnapshot_s &ar_metrics)
+{
+  std::ostringstream out;
+  const std::vector<__HAL::metricsSnapshot_s::bus_s> &r_busses = ar_metrics.mvec_busses;
+  const std::vector<__HAL::metricsSnapshot_s::client_s> &r_clients = ar_metrics.mvec_clients;
+
+  gauge(out, "can_server_clients", "Connected clients.");
+  out << "can_server_clients " << r_clients.size() << "\n";
+
+  gauge(out, "can_server_bus_open", "1 if a client has opened the bus.");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+    out << "can_server_bus_open{bus=\"" << n_bus << "\"} " << (r_busses[n_bus].mb_open ? 1 : 0) << "\n";
+
+  gauge(out, "can_server_bus_load_ratio", "Bus load from the frames received and sent, with worst-case bit stuffing.");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+  {
+    for (int i = 0; i < __HAL::BUS_LOAD_WINDOWS; ++i)
+      out << "can_server_bus_load_ratio{bus=\"" << n_bus << "\",window=\"" << scarrpc_busLoadWindow[i] << "\"} "
+          << r_busses[n_bus].marrui32_load[i] / 10000.0 << "\n";
+  }
+
+  counter(out, "can_server_bus_rx_frames_total", "Frames received from the bus.");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+    out << "can_server_bus_rx_frames_total{bus=\"" << n_bus << "\"} " << r_busses[n_bus].ms_stats.mui32_rxFrames << "\n";
+  counter(out, "can_server_bus_rx_bytes_total", "Data bytes received from the bus.");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+    out << "can_server_bus_rx_bytes_total{bus=\"" << n_bus << "\"} " << r_busses[n_bus].ms_stats.mui32_rxBytes << "\n";
+  counter(out, "can_server_bus_tx_frames_total", "Frames sent to the bus.");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+    out << "can_server_bus_tx_frames_total{bus=\"" << n_bus << "\"} " << r_busses[n_bus].ms_stats.mui32_txFrames << "\n";
+  counter(out, "can_server_bus_tx_bytes_total", "Data bytes sent to the bus.");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+    out << "can_server_bus_tx_bytes_total{bus=\"" << n_bus << "\"} " << r_busses[n_bus].ms_stats.mui32_txBytes << "\n";
+  counter(out, "can_server_bus_tx_dropped_total", "Frames dropped because the bus TX queue was full.");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+    out << "can_server_bus_tx_dropped_total{bus=\"" << n_bus << "\"} " << r_busses[n_bus].ms_stats.mui32_txDropped << "\n";
+  counter(out, "can_server_bus_tx_local_total", "Frames for clients only, not sent to the bus (--reduced-load-iso-bus-no).");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+    out << "can_server_bus_tx_local_total{bus=\"" << n_bus << "\"} " << r_busses[n_bus].ms_stats.mui32_txLocal << "\n";
+  gauge(out, "can_server_bus_tx_queued", "Frames waiting for the CAN device.");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+    out << "can_server_bus_tx_queued{bus=\"" << n_bus << "\"} " << r_busses[n_bus].mui32_txQueued << "\n";
+  counter(out, "can_server_bus_tx_errors_total", "Frames the CAN device did not accept in time.");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+    out << "can_server_bus_tx_errors_total{bus=\"" << n_bus << "\"} " << r_busses[n_bus].ms_stats.mui32_txErrors << "\n";
+  counter(out, "can_server_bus_tp_messages_total", "Transport protocol messages reassembled for subscribed clients.");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+    out << "can_server_bus_tp_messages_total{bus=\"" << n_bus << "\"} " << r_busses[n_bus].ms_stats.mui32_tpMessages << "\n";
+  counter(out, "can_server_bus_tp_aborted_total", "Transport protocol transfers aborted or timed out.");
+  for (size_t n_bus = 0; n_bus < r_busses.size(); ++n_bus)
+    out << "can_server_bus_tp_aborted_total{bus=\"" << n_bus << "\"} " << r_busses[n_bus].ms_stats.mui32_tpAborted << "\n";
+
+  counter(out, "can_server_client_rx_frames_total", "Frames received from the client.");
+  for (size_t n_client = 0; n_client < r_clients.size(); ++n_client)
+    out << "can_server_client_rx_frames_total{client=\"" << n_client << "\"} " << r_clients[n_client].mui32_rxFrames << "\n";
+  counter(out, "can_server_client_delivered_total", "Frames delivered to the client.");
+  for (size_t n_client = 0; n_client < r_clients.size(); ++n_client)
+    out << "can_server_client_delivered_total{client=\"" << n_client << "\"} " << r_clients[n_client].mui32_delivered << "\n";
+  counter(out, "can_server_client_dropped_total", "Frames dropped because the client's TX queue was full.");
+  for (size_t n_client = 0; n_client < r_clients.size(); ++n_client)
+    out << "can_server_client_dropped_total{client=\"" << n_client << "\"} " << r_clients[n_client].mui32_dropped << "\n";
+  counter(out, "can_server_client_send_errors_total", "Failed sends to the client.");
+  for (size_t n_client = 0; n_client < r_clients.size(); ++n_client)
+    out << "can_server_client_send_errors_total{client=\"" << n_client << "\"} " << r_clients[n_client].mui32_sendErrors << "\n";
+  gauge(out, "can_server_client_queued", "Frames waiting in the client's TX queue.");
+  for (size_t n_client = 0; n_client < r_clients.size(); ++n_client)
+    out << "can_server_client_queued{client=\"" << n_client << "\"} " << r_clients[n_client].mui32_queued << "\n";
+
+  counter(out, "can_server_commands_total", "Commands received from the clients.");
+  for (uint16_t ui16_command = 0; ui16_command < CAN_SERVER_STATS_COMMANDS; ++ui16_command)
+  {
+    if (ar_metrics.marrui32_commandCount[ui16_command])
+      out << "can_server_commands_total{command=\"" << commandName(ui16_command) << "\"} " << ar_metrics.marrui32_commandCount[ui16_command] << "\n";
+  }
+
+  counter(out, "can_server_log_dropped_total", "Frames dropped because the log writer lagged behind.");
+  out << "can_server_log_dropped_total " << ar_metrics.mui32_logDropped << "\n";
+
+  out << "# HELP can_server_forward_latency_seconds Forwarding latency through the server.\n"
+      << "# TYPE can_server_forward_latency_seconds summary\n";
+  for (int i = 0; i < __HAL::LATENCY_COUNT; ++i)
+  {
+    const __HAL::latencyHistogram_s &r_histogram = ar_metrics.marrs_latency[i];
+    for (size_t n = 0; n < sizeof(scarrd_quantile) / sizeof(scarrd_quantile[0]); ++n)
+      out << "can_server_forward_latency_seconds{path=\"" << scarrpc_latencyPath[i] << "\",quantile=\"" << scarrd_quantile[n] << "\"} "
+          << r_histogram.valueAtPercentile(scarrd_quantile[n] * 100.0) / 1e6 << "\n";
+    out << "can_server_forward_latency_seconds_sum{path=\"" << scarrpc_latencyPath[i] << "\"} " << double(r_histogram.mui64_sum) / 1e6 << "\n"
+        << "can_server_forward_latency_seconds_count{path=\"" << scarrpc_latencyPath[i] << "\"} " << r_histogram.mui32_total << "\n";
+  }
+  return out.str();
+}
+
+// read the request (which is not looked at) and answer with the current metrics
+void serve(SOCKET_TYPE a_socket, __HAL::server_c *ap_server)
+{
+  std::string str_request;
+  char arrc_buf[512];
+  while (str_request.find("\r\n\r\n") == std::string::npos) {
+    if (!waitReadable(a_socket, sci_requestTimeout))
+      return;
+    const int ci_received = recv(a_socket, arrc_buf, sizeof(arrc_buf), 0);
+    if (ci_received <= 0)
+      return;
+    str_request.append(arrc_buf, ci_received);
+    if (str_request.size() > 8192)
+      return;
+  }
+
+  // readWrite() fills the snapshot, the thread waits here and not readWrite() on it
+  handOverRequest(REQUEST_METRICS, ap_server, true);
+  pthread_mutex_lock( &(ap_server->mt_protectMetrics) );
+  const std::string cstr_body = render(ap_server->ms_metrics);
+  pthread_mutex_unlock( &(ap_server->mt_protectMetrics) );
+
+  std::ostringstream out;
+  out << "HTTP/1.0 200 OK\r\n"
+      << "Content-Type: text/plain; version=0.0.4\r\n"
+      << "Content-Length: " << cstr_body.size() << "\r\n"
+      << "Connection: close\r\n\r\n"
+      << cstr_body;
+  const std::string cstr_response = out.str();
+  size_t n_sent = 0;
+  while (n_sent < cstr_response.size()) {
+    const int ci_sent = send(a_socket, cstr_response.data() + n_sent, int(cstr_response.size() - n_sent), 0);
+    if (ci_sent <= 0)
+      break;
+    n_sent += ci_sent;
+  }
+}
+
+void *metrics(void *ap_arg)
+{
+  __HAL::server_c *p_server = static_cast< __HAL::server_c * >(ap_arg);
+
+  // scrapes must not compete with the frame forwarding
+#ifdef WIN32
+  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#else
+  (void)setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+
+  std::vector<SOCKET_TYPE> vec_listen;
+  if (p_server->mi_metricsPort > 0) {
+    const SOCKET_TYPE c_socket = listenTcp(p_server->mi_metricsPort);
+    if (c_socket == INVALID_SOCKET)
+      std::cerr << "Error: can not serve metrics on port " << p_server->mi_metricsPort << "." << std::endl;
+    else
+      vec_listen.push_back(c_socket);
+  }
+#ifndef WIN32
+  if (!p_server->mstr_metricsSocket.empty()) {
+    const SOCKET_TYPE c_socket = listenUnix(p_server->mstr_metricsSocket);
+    if (c_socket == INVALID_SOCKET)
+      std::cerr << "Error: can not serve metrics on " << p_server->mstr_metricsSocket << "." << std::endl;
+    else
+      vec_listen.push_back(c_socket);
+  }
+#endif
+
+  while (!vec_listen.empty()) {
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    int i_maxFd = 0;
+    for (size_t n = 0; n < vec_listen.size(); ++n) {
+      FD_SET(vec_listen[n], &readSet);
+      if (int(vec_listen[n]) > i_maxFd)
+        i_maxFd = int(vec_listen[n]);
+    }
+    if (select(i_maxFd + 1, &readSet, NULL, NULL, NULL) <= 0)
+      continue;
+
+    for (size_t n = 0; n < vec_listen.size(); ++n) {
+      if (!FD_ISSET(vec_listen[n], &readSet))
+        continue;
+      const SOCKET_TYPE c_socket = accept(vec_listen[n], NULL, NULL);
+      if (c_socket == INVALID_SOCKET)
+        continue;
+      serve(c_socket, p_server);
+      closeSocket(c_socket);
+    }
+  }
+  return NULL;
+}
+
+} // namespace
+
+void startMetrics(__HAL::server_c* pc_serverData)
+{
+  pthread_t t_metrics;
+  if (pthread_create( &t_metrics, NULL, &metrics, pc_serverData )) {
+    std::cerr << "Could not create metrics thread!" << std::endl;
+    exit( 1 );
+  }
+  (void)pthread_detach( t_metrics );
+}
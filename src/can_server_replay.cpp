@@ -0,0 +1,196 @@
+/*
+  can_server_replay.cpp: Replay of a recorded log file (--file-input)
+
+  (C) Copyright 2009 - 2022 by OSB connagtive GmbH
+
+  Use, modification and distribution are subject to the GNU General
+  Public License, see accompanying file LICENSE.txt
+*/
+
+#include "can_server_common.h"
+
+#include <iostream>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER)
+#pragma warning( disable : 4996 )
+#endif
+
+namespace {
+
+// frames collected before they are handed over to readWrite() at once
+const size_t scn_replayBatch = 64;
+
+void sleepMsec(int32_t ai32_msec)
+{
+#ifdef WIN32
+  Sleep( ai32_msec );
+#else
+  usleep( ai32_msec * 1000 );
+#endif
+}
+
+bool isBinaryLog(FILE *f_input)
+{
+  char arrc_magic[8];
+  const bool cb_binary = (fread( arrc_magic, sizeof(arrc_magic), 1, f_input ) == 1) &&
+                         !memcmp( arrc_magic, CAN_LOG_BINARY_MAGIC, sizeof(arrc_magic) );
+  rewind( f_input );
+  return cb_binary;
+}
+
+// one line written by dumpCanMsg(), false at the end of the file
+bool readTextFrame(FILE *f_input, canLogFrame_s &ar_frame)
+{
+  char arrc_line[256];
+  while (fgets( arrc_line, sizeof(arrc_line), f_input )) {
+    int i_msec, i_usec = 0, i_bus, i_obj, i_xtd, i_len, i_prio, i_pos;
+    unsigned u_id;
+    // [msec] with 3 decimals, or without them in logs of older versions
+    if (sscanf( arrc_line, "%d%n", &i_msec, &i_pos ) != 1)
+      continue;
+    const char *pc_fields = arrc_line + i_pos;
+    if ((*pc_fields == '.') && (sscanf( pc_fields + 1, "%3d%n", &i_usec, &i_pos ) == 1))
+      pc_fields += 1 + i_pos;
+    if ((sscanf( pc_fields, "%d %d %d %d %d %x%n",
+                 &i_bus, &i_obj, &i_xtd, &i_len, &i_prio, &u_id, &i_pos ) != 6) ||
+        (i_bus < 0) || (i_len < 0) || (i_len > 8))
+      continue; // not a frame
+
+    const char *pc_data = pc_fields + i_pos;
+    int i_byte = 0;
+    for (; i_byte < i_len; ++i_byte) {
+      unsigned u_value;
+      int i_chars;
+      if (sscanf( pc_data, "%x%n", &u_value, &i_chars ) != 1)
+        break;
+      ar_frame.s_canMsg.ui8_data[i_byte] = uint8_t(u_value);
+      pc_data += i_chars;
+    }
+    if (i_byte < i_len)
+      continue; // truncated line
+
+    ar_frame.i64_time = int64_t(i_msec) * 1000 + i_usec;
+    ar_frame.ui8_bus = uint8_t(i_bus);
+    ar_frame.ui8_obj = uint8_t(i_obj);
+    ar_frame.s_canMsg.ui32_id = u_id;
+    ar_frame.s_canMsg.i32_msgType = i_xtd;
+    ar_frame.s_canMsg.i32_len = i_len;
+    return true;
+  }
+  return false;
+}
+
+// hand the batch over, wait while readWrite() lags behind
+void handOver(std::vector< __HAL::transferBuf_s > &arvec_batch, __HAL::server_c *ap_server)
+{
+  std::vector< __HAL::transferBuf_s > vec_none;
+  size_t n_pending = handOverReplayMsgs( arvec_batch, ap_server );
+  while (n_pending > CAN_SERVER_REPLAY_MAX_PENDING) {
+    sleepMsec( 1 );
+    n_pending = handOverReplayMsgs( vec_none, ap_server );
+  }
+}
+
+void *replay(void *ap_arg)
+{
+  __HAL::server_c *p_server = static_cast< __HAL::server_c * >(ap_arg);
+  FILE *f_input = p_server->mf_canInput;
+  const bool cb_binary = isBinaryLog( f_input );
+  const double cd_speed = p_server->md_replaySpeed;
+  uint16_t ui16_version = 0;
+  bool b_error = false;
+
+  while (!p_server->mb_replayStart)
+    sleepMsec( 10 );
+
+  std::vector< __HAL::transferBuf_s > vec_batch;
+  vec_batch.reserve( scn_replayBatch );
+
+  // frame time t is due at i64_start + (t - i64_firstTime) / speed [usec]; the time
+  // base is restarted after each loop and where the recorded time jumps back
+  int64_t i64_start = __HAL::getTimeUsec();
+  int64_t i64_due = i64_start;
+  bool b_restart = true;
+  int64_t i64_firstTime = 0;
+  int64_t i64_lastTime = 0;
+  bool b_framesInPass = false;
+
+  for (;;) {
+    canLogFrame_s s_frame;
+    memset( &s_frame, 0, sizeof(s_frame) );
+    const bool cb_read = cb_binary ? canLogReadBinary( f_input, ui16_version, s_frame, b_error ) : readTextFrame( f_input, s_frame );
+    if (!cb_read) {
+      if (b_error) {
+        std::cerr << "Error: unsupported replay file version " << ui16_version << "." << std::endl;
+        break;
+      }
+      if (!p_server->mb_replayLoop || !b_framesInPass)
+        break;
+      rewind( f_input );
+      b_restart = true;
+      b_framesInPass = false;
+      continue;
+    }
+    b_framesInPass = true;
+
+    if (s_frame.ui8_bus >= HAL_CAN_MAX_BUS_NR)
+      continue;
+
+    if (b_restart || (s_frame.i64_time < i64_lastTime)) {
+      i64_start = i64_due;
+      i64_firstTime = s_frame.i64_time;
+      b_restart = false;
+    }
+    i64_lastTime = s_frame.i64_time;
+
+    if (cd_speed > 0) {
+      i64_due = i64_start + int64_t((s_frame.i64_time - i64_firstTime) / cd_speed);
+      // sleeping is done in whole [msec], shorter gaps are caught up with the next sleep
+      if (i64_due - __HAL::getTimeUsec() >= 1000) {
+        // everything that was due until now goes out before sleeping
+        if (!vec_batch.empty())
+          handOver( vec_batch, p_server );
+        int64_t i64_wait;
+        while ((i64_wait = i64_due - __HAL::getTimeUsec()) >= 1000)
+          sleepMsec( int32_t(i64_wait / 1000) );
+      }
+    }
+
+    __HAL::transferBuf_s s_transferBuf;
+    s_transferBuf.s_data.s_canMsg = s_frame.s_canMsg;
+    s_transferBuf.s_data.ui8_bus = p_server->marrui8_replayBusMap[s_frame.ui8_bus];
+    vec_batch.push_back( s_transferBuf );
+
+    if (vec_batch.size() >= scn_replayBatch)
+      handOver( vec_batch, p_server );
+  }
+
+  if (!vec_batch.empty())
+    handOver( vec_batch, p_server );
+
+  if (p_server->mb_interactive)
+    std::cerr << "Replay of " << p_server->mstr_inputFile << " finished." << std::endl;
+  return NULL;
+}
+
+} // namespace
+
+void startReplay(__HAL::server_c* pc_serverData)
+{
+  pc_serverData->mf_canInput = fopen( pc_serverData->mstr_inputFile.c_str(), "rb" );
+  if (!pc_serverData->mf_canInput) {
+    std::cerr << "Error: can not open replay file " << pc_serverData->mstr_inputFile << "." << std::endl;
+    exit( 1 );
+  }
+
+  pthread_t t_replay;
+  if (pthread_create( &t_replay, NULL, &replay, pc_serverData )) {
+    std::cerr << "Could not create replay thread!" << std::endl;
+    exit( 1 );
+  }
+  (void)pthread_detach( t_replay );
+}
@@ -0,0 +1,139 @@
+/*
+  can_server_shm.cpp: Shared memory data path for local clients
+
+  (C) Copyright 2009 - 2022 by OSB connagtive GmbH
+
+  Use, modification and distribution are subject to the GNU General
+  Public License, see accompanying file LICENSE.txt
+*/
+#include "can_server_shm.h"
+
+#ifdef CAN_SERVER_USE_SHM
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+
+namespace __HAL {
+
+static void shmName(char *pc_name, size_t n_size, int32_t i32_id)
+{
+  snprintf(pc_name, n_size, "%s%d.%d", CAN_SERVER_SHM_NAME, COMMAND_TRANSFER_PORT, i32_id);
+}
+
+bool shmCreate(server_c &ar_server, client_c &ar_client)
+{
+  char arrc_name[64];
+  const int32_t ci32_id = ar_server.mi32_nextShmId++;
+  shmName(arrc_name, sizeof(arrc_name), ci32_id);
+
+  // remove a segment left over by a killed server
+  (void)shm_unlink(arrc_name);
+
+  const int ci_fd = shm_open(arrc_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (ci_fd < 0)
+  {
+    perror("shm_open");
+    return false;
+  }
+
+  void *p_mapping = MAP_FAILED;
+  if (ftruncate(ci_fd, sizeof(shmSegment_s)) == 0)
+    p_mapping = mmap(NULL, sizeof(shmSegment_s), PROT_READ | PROT_WRITE, MAP_SHARED, ci_fd, 0);
+  close(ci_fd);
+
+  if (p_mapping == MAP_FAILED)
+  {
+    perror("shared memory segment");
+    (void)shm_unlink(arrc_name);
+    return false;
+  }
+
+  memset(p_mapping, 0, sizeof(shmSegment_s));
+  ar_client.mp_shm = static_cast<shmSegment_s*>(p_mapping);
+  ar_client.mp_shm->ui32_ringSize = CAN_SERVER_SHM_RING_SIZE;
+  __atomic_store_n(&ar_client.mp_shm->ui32_magic, uint32_t(CAN_SERVER_SHM_MAGIC), __ATOMIC_RELEASE);
+  ar_client.mi32_shmId = ci32_id;
+
+  DEBUG_PRINT1("created shared memory segment %s\n", arrc_name);
+  return true;
+}
+
+void shmRelease(client_c &ar_client)
+{
+  if (ar_client.mp_shm == NULL)
+    return;
+
+  char arrc_name[64];
+  shmName(arrc_name, sizeof(arrc_name), ar_client.mi32_shmId);
+  (void)munmap(ar_client.mp_shm, sizeof(shmSegment_s));
+  (void)shm_unlink(arrc_name);
+
+  ar_client.mp_shm = NULL;
+  ar_client.mi32_shmId = -1;
+}
+
+bool shmPushToClient(client_c &ar_client, const transferBuf_s &ar_transferBuf)
+{
+  shmRing_s &r_ring = ar_client.mp_shm->s_toClient;
+  const uint32_t cui32_head = r_ring.ui32_head;
+
+  if (cui32_head - __atomic_load_n(&r_ring.ui32_tail, __ATOMIC_ACQUIRE) >= CAN_SERVER_SHM_RING_SIZE)
+    return false;
+
+  r_ring.arrs_records[cui32_head % CAN_SERVER_SHM_RING_SIZE] = ar_transferBuf;
+  __atomic_store_n(&r_ring.ui32_head, cui32_head + 1, __ATOMIC_RELEASE);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  uint32_t ui32_waiting = 1;
+  if (__atomic_load_n(&r_ring.ui32_consumerWaiting, __ATOMIC_RELAXED)
+      && __atomic_compare_exchange_n(&r_ring.ui32_consumerWaiting, &ui32_waiting, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+  {
+    (void)syscall(SYS_futex, &r_ring.ui32_head, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+  return true;
+}
+
+bool shmPopFromClient(client_c &ar_client, transferBuf_s &ar_transferBuf)
+{
+  shmRing_s &r_ring = ar_client.mp_shm->s_toServer;
+  const uint32_t cui32_tail = r_ring.ui32_tail;
+  const uint32_t cui32_head = __atomic_load_n(&r_ring.ui32_head, __ATOMIC_ACQUIRE);
+
+  if (cui32_head == cui32_tail)
+    return false;
+
+  if (cui32_head - cui32_tail > CAN_SERVER_SHM_RING_SIZE)
+  { // the client wrote a head which can't be valid
+    DEBUG_PRINT("corrupt shared memory ring, dropping its content\n");
+    __atomic_store_n(&r_ring.ui32_tail, cui32_head, __ATOMIC_RELEASE);
+    return false;
+  }
+
+  ar_transferBuf = r_ring.arrs_records[cui32_tail % CAN_SERVER_SHM_RING_SIZE];
+  __atomic_store_n(&r_ring.ui32_tail, cui32_tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool shmPrepareWait(client_c &ar_client)
+{
+  shmRing_s &r_ring = ar_client.mp_shm->s_toServer;
+
+  __atomic_store_n(&r_ring.ui32_consumerWaiting, 1u, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r_ring.ui32_head, __ATOMIC_ACQUIRE) == r_ring.ui32_tail)
+    return false;
+
+  // pending records will be read right away, no doorbell needed
+  __atomic_store_n(&r_ring.ui32_consumerWaiting, 0u, __ATOMIC_RELAXED);
+  return true;
+}
+
+} // namespace __HAL
+
+#endif
@@ -0,0 +1,33 @@
+/*
+  can_server_shm.h: Shared memory data path for local clients
+
+  (C) Copyright 2009 - 2022 by OSB connagtive GmbH
+
+  Use, modification and distribution are subject to the GNU General
+  Public License, see accompanying file LICENSE.txt
+*/
+#ifndef CAN_SERVER_SHM_H
+#define CAN_SERVER_SHM_H
+
+#include "can_server_common.h"
+
+#ifdef CAN_SERVER_USE_SHM
+
+// The protocol and the segment layout are described at shmSegment_s.
+namespace __HAL {
+  // create and map a new segment for the client (sets mp_shm and mi32_shmId)
+  bool shmCreate(server_c &ar_server, client_c &ar_client);
+  // unmap and remove the client's segment
+  void shmRelease(client_c &ar_client);
+
+  // false if the client's ring is full
+  bool shmPushToClient(client_c &ar_client, const transferBuf_s &ar_transferBuf);
+  // false if the client didn't write anything
+  bool shmPopFromClient(client_c &ar_client, transferBuf_s &ar_transferBuf);
+  // readWrite() is going to sleep: request a doorbell, true if records are pending already
+  bool shmPrepareWait(client_c &ar_client);
+}
+
+#endif
+
+#endif
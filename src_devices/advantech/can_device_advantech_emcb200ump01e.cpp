@@ -439,8 +439,7 @@ void closeBusOnCard(uint8_t ui8_bus, server_c* pc_serverData)
 int16_t sendToBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
 {
   (void)pc_serverData;
-  UINT32 ret;
-  while ((ret = EMCBMsgTx(ui8_bus, ps_canMsg->ui32_id, ps_canMsg->i32_msgType ? ADV_EXTENDED_FRAME : ADV_STANDARD_FRAME, 0, ps_canMsg->ui8_data, ps_canMsg->i32_len)) == EMCB_STATUS_WRITE_BUSY) {}
+  const UINT32 ret = EMCBMsgTx(ui8_bus, ps_canMsg->ui32_id, ps_canMsg->i32_msgType ? ADV_EXTENDED_FRAME : ADV_STANDARD_FRAME, 0, ps_canMsg->ui8_data, ps_canMsg->i32_len);
   switch(ret)
   {
     case EMCB_STATUS_SUCCESS:
@@ -448,6 +447,11 @@ int16_t sendToBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
        return 1;
     }
     break;
+    case EMCB_STATUS_WRITE_BUSY:
+    {
+      return 0; // TX buffer full, the server queues the frame and retries
+    }
+    break;
     case EMCB_STATUS_NOT_INITIALIZED:
     {
       printf("Tried to send a message via CAN although the EMCB-Library has not been initialized! (line %d)\n", __LINE__);
@@ -594,3 +598,9 @@ bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
   }
 }
 
+// no bulk read in the driver API
+size_t readFromBusBatch(uint8_t ui8_bus, canMsg_s* ps_canMsgs, int64_t* pi64_rxTimes, size_t n_maxMsgs, server_c* pc_serverData)
+{
+  return readFromBusBatchDefault(ui8_bus, ps_canMsgs, pi64_rxTimes, n_maxMsgs, pc_serverData);
+}
+
@@ -18,6 +18,9 @@
 #define HARDWARE "KVASER"
 #define HARDWARE_PATCH 0
 
+// [usec] per step of the canRead() time stamps (canIOCTL_SET_TIMER_SCALE)
+#define KVASER_TIMER_SCALE 10
+
 using namespace __HAL;
 
 static struct canDevice_s {
@@ -25,6 +28,9 @@ static struct canDevice_s {
         bool      mb_canBusIsOpen;
         bool      mb_channelVirtual;
         CanHandle mi_channelHandle;
+        // [usec] per step of the canRead() time stamps, see KVASER_TIMER_SCALE
+        unsigned int mui_timerScale;
+        rxClockSync_s ms_rxClock;
         canBus_s();
     };
     canBus_s& canBus(size_t n_index);
@@ -62,7 +68,9 @@ inline size_t canDevice_s::nCanBusses()
 canDevice_s::canBus_s::canBus_s() :
     mb_canBusIsOpen(false),
     mb_channelVirtual(false),
-    mi_channelHandle(-1)
+    mi_channelHandle(-1),
+    mui_timerScale(1000),
+    ms_rxClock()
 {
 }
 
@@ -254,6 +262,12 @@ bool openBusOnCard(uint8_t ui8_bus, uint32_t wBitrate, server_c* pc_serverData)
 
         DEBUG_PRINT1("CAN bus channel bitrate %d kb/s\n", wBitrate);
 
+        // finer receive time stamps than the default [msec]
+        unsigned int ui_timerScale = KVASER_TIMER_SCALE;
+        status = canIoCtl(channelHandle, canIOCTL_SET_TIMER_SCALE, &ui_timerScale, sizeof(ui_timerScale));
+        ss_canDevice.canBus(ui8_bus).mui_timerScale = (status == canOK) ? KVASER_TIMER_SCALE : 1000;
+        ss_canDevice.canBus(ui8_bus).ms_rxClock = rxClockSync_s();
+
         status = canBusOn(channelHandle);
 
         if (status != canOK)
@@ -345,7 +359,8 @@ int16_t sendToBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
     }
 }
 
-bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
+// pi64_rxTime: receive time stamp, if not NULL
+static bool readMsg(uint8_t ui8_bus, canMsg_s* ps_canMsg, int64_t* pi64_rxTime)
 {
     canStatus     status;
     long          id;
@@ -381,12 +396,32 @@ bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
 
         (void)memcpy(ps_canMsg->ui8_data, payload, payloadSize);
 
+        if (pi64_rxTime)
+        {
+            canDevice_s::canBus_s &r_bus = ss_canDevice.canBus(ui8_bus);
+            *pi64_rxTime = rxTimeToServerTime(r_bus.ms_rxClock, int64_t(timestamp) * r_bus.mui_timerScale);
+        }
+
         return true;
     }
 
     return false;
 }
 
+bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* /* pc_serverData */)
+{
+    return readMsg(ui8_bus, ps_canMsg, NULL);
+}
+
+// no bulk read in the driver API, but time stamps
+size_t readFromBusBatch(uint8_t ui8_bus, canMsg_s* ps_canMsgs, int64_t* pi64_rxTimes, size_t n_maxMsgs, server_c* /* pc_serverData */)
+{
+    size_t n_read = 0;
+    while ((n_read < n_maxMsgs) && readMsg(ui8_bus, ps_canMsgs + n_read, pi64_rxTimes + n_read))
+        ++n_read;
+    return n_read;
+}
+
 int32_t getServerTimeFromClientTime(client_c& r_receiveClient, int32_t ai32_clientTime)
 {
     return ai32_clientTime + r_receiveClient.i32_msecStartDeltaClientMinusServer;
@@ -238,6 +238,12 @@ bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
 	}
 }
 
+// no bulk read in the driver API
+size_t readFromBusBatch(uint8_t ui8_bus, canMsg_s* ps_canMsgs, int64_t* pi64_rxTimes, size_t n_maxMsgs, server_c* pc_serverData)
+{
+	return readFromBusBatchDefault(ui8_bus, ps_canMsgs, pi64_rxTimes, n_maxMsgs, pc_serverData);
+}
+
 
 // PURPOSE: To send a msg on the specified CAN BUS
 // RETURNS: non-zero if msg was sent ok
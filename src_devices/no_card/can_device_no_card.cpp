@@ -99,3 +99,8 @@ bool readFromBus(uint8_t /* ui8_bus */, canMsg_s* /* ps_canMsg */, server_c* /*
   return false;
 }
 
+size_t readFromBusBatch(uint8_t /* ui8_bus */, canMsg_s* /* ps_canMsgs */, int64_t* /* pi64_rxTimes */, size_t /* n_maxMsgs */, server_c* /* pc_serverData */)
+{
+  return 0;
+}
+
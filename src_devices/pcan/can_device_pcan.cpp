@@ -39,6 +39,7 @@ static struct canDevice_s {
     bool          mb_canBusIsOpen;
     bool          mb_channelVirtual;
     TPCANHandle   m_channel;
+    rxClockSync_s ms_rxClock;
     canBus_s();
   };
   canBus_s &canBus(size_t n_index);
@@ -63,7 +64,8 @@ inline size_t canDevice_s::nCanBusses()
 canDevice_s::canBus_s::canBus_s() :
   mb_canBusIsOpen(false),
   mb_channelVirtual(false),
-  m_channel(PCAN_NONEBUS)
+  m_channel(PCAN_NONEBUS),
+  ms_rxClock()
 {
 }
 
@@ -350,8 +352,10 @@ int16_t sendToBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
 #endif
 }
 
-bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
+// pi64_rxTime: receive time stamp, if not NULL
+static bool readMsg(uint8_t ui8_bus, canMsg_s* ps_canMsg, int64_t* pi64_rxTime, server_c* pc_serverData)
 {
+  int64_t i64_deviceTime; // [usec]
 #if WIN32
   TPCANMsg msg;
   TPCANStatus status;
@@ -367,6 +371,8 @@ bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
   {
     return false;
   }
+  i64_deviceTime = int64_t(timestamp.micros) + 1000 * int64_t(timestamp.millis)
+                 + 1000 * (int64_t(timestamp.millis_overflow) << 32);
 
 #else
   TPCANRdMsg msgRd;
@@ -375,6 +381,7 @@ bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
     return false;
 
   TPCANMsg& msg = msgRd.Msg;
+  i64_deviceTime = 1000 * int64_t(msgRd.dwTime) + msgRd.wUsec;
 #endif
 
   switch (msg.MSGTYPE)
@@ -392,9 +399,26 @@ bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
 
   (void) memcpy( ps_canMsg->ui8_data, msg.DATA, msg.LEN );
 
+  if (pi64_rxTime)
+    *pi64_rxTime = rxTimeToServerTime(ss_canDevice.canBus(ui8_bus).ms_rxClock, i64_deviceTime);
+
   return true;
 }
 
+bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
+{
+  return readMsg(ui8_bus, ps_canMsg, NULL, pc_serverData);
+}
+
+// no bulk read in the driver API, but time stamps
+size_t readFromBusBatch(uint8_t ui8_bus, canMsg_s* ps_canMsgs, int64_t* pi64_rxTimes, size_t n_maxMsgs, server_c* pc_serverData)
+{
+  size_t n_read = 0;
+  while ((n_read < n_maxMsgs) && readMsg(ui8_bus, ps_canMsgs + n_read, pi64_rxTimes + n_read, pc_serverData))
+    ++n_read;
+  return n_read;
+}
+
 int32_t getServerTimeFromClientTime( client_c& r_receiveClient, int32_t ai32_clientTime )
 {
   return ai32_clientTime + r_receiveClient.i32_msecStartDeltaClientMinusServer;
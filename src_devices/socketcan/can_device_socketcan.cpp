@@ -0,0 +1,338 @@
+/*
+  can_device_socketcan.cpp: Interface for Linux SocketCAN network devices
+
+  (C) Copyright 2009 - 2022 by OSB connagtive GmbH
+
+  Use, modification and distribution are subject to the GNU General
+  Public License, see accompanying file LICENSE.txt
+*/
+#include "can_server_common.h"
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <iostream>
+#include <assert.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#define HARDWARE "SocketCAN"
+#define HARDWARE_PATCH 0
+
+// frames fetched from the socket with one recvmmsg() call
+#define SOCKETCAN_RX_BATCH 32
+
+using namespace __HAL;
+
+static struct canDevice_s {
+  struct canBus_s {
+    bool          mb_canBusIsOpen;
+    bool          mb_channelVirtual;
+    int           mi_socket;
+    // frames received with the last recvmmsg(), handed out by readFromBus()/readFromBusBatch()
+    struct can_frame arrs_rxFrame[SOCKETCAN_RX_BATCH];
+    struct iovec     arrs_rxIov[SOCKETCAN_RX_BATCH];
+    struct mmsghdr   arrs_rxMsg[SOCKETCAN_RX_BATCH];
+    char             arrc_rxControl[SOCKETCAN_RX_BATCH][CMSG_SPACE(sizeof(struct scm_timestamping))];
+    int              mi_rxFill;
+    int              mi_rxPos;
+    // maps the kernel RX timestamps onto the server time
+    rxClockSync_s    ms_rxClock;
+    canBus_s();
+  };
+  canBus_s &canBus(size_t n_index);
+  size_t nCanBusses();
+
+private:
+  std::vector< canBus_s > mvec_canBus;
+} ss_canDevice;
+
+inline canDevice_s::canBus_s &canDevice_s::canBus(size_t n_index)
+{
+  if (mvec_canBus.size() <= n_index)
+    mvec_canBus.resize(n_index + 1);
+  return mvec_canBus[n_index];
+}
+
+inline size_t canDevice_s::nCanBusses()
+{
+  return mvec_canBus.size();
+}
+
+canDevice_s::canBus_s::canBus_s() :
+  mb_canBusIsOpen(false),
+  mb_channelVirtual(false),
+  mi_socket(-1),
+  mi_rxFill(0),
+  mi_rxPos(0),
+  ms_rxClock()
+{
+  memset(arrs_rxFrame, 0, sizeof(arrs_rxFrame));
+  memset(arrs_rxIov, 0, sizeof(arrs_rxIov));
+  memset(arrs_rxMsg, 0, sizeof(arrs_rxMsg));
+  memset(arrc_rxControl, 0, sizeof(arrc_rxControl));
+}
+
+bool isBusOpen(uint8_t ui8_bus)
+{
+  return ss_canDevice.canBus(ui8_bus).mb_canBusIsOpen;
+}
+
+const char* getHardware()
+{
+  return HARDWARE;
+}
+
+unsigned getHardwarePatch()
+{
+  return HARDWARE_PATCH;
+}
+
+uint32_t initCardApi ()
+{
+  return 1;
+}
+
+bool resetCard(void)
+{
+  return true;
+}
+
+
+// open and bind a raw CAN socket on the given network interface, -1 on failure
+static int openCanSocket(const char* pc_interface)
+{
+  const int ci_socket = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (ci_socket < 0)
+  {
+    perror("socket(PF_CAN)");
+    return -1;
+  }
+
+  struct ifreq s_ifr;
+  memset(&s_ifr, 0, sizeof(s_ifr));
+  strncpy(s_ifr.ifr_name, pc_interface, IFNAMSIZ - 1);
+  if (ioctl(ci_socket, SIOCGIFINDEX, &s_ifr) < 0)
+  {
+    DEBUG_PRINT1("CAN interface %s not found\n", pc_interface);
+    close(ci_socket);
+    return -1;
+  }
+
+  struct sockaddr_can s_addr;
+  memset(&s_addr, 0, sizeof(s_addr));
+  s_addr.can_family = AF_CAN;
+  s_addr.can_ifindex = s_ifr.ifr_ifindex;
+  if (bind(ci_socket, (struct sockaddr *)&s_addr, sizeof(s_addr)) < 0)
+  {
+    perror("bind CAN socket");
+    close(ci_socket);
+    return -1;
+  }
+
+  // readFromBus() must not block the main loop
+  (void)fcntl(ci_socket, F_SETFL, fcntl(ci_socket, F_GETFL) | O_NONBLOCK);
+
+  // kernel RX timestamps, hardware ones where the controller provides them
+  int i_timestamping = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE
+                     | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  if (setsockopt(ci_socket, SOL_SOCKET, SO_TIMESTAMPING, &i_timestamping, sizeof(i_timestamping)) < 0)
+  {
+    DEBUG_PRINT1("SO_TIMESTAMPING not supported on %s\n", pc_interface);
+  }
+
+  return ci_socket;
+}
+
+
+// PURPOSE: To initialize the specified CAN BUS to begin sending/receiving msgs
+// Bus n is the network interface "can<n>" (with '--virtual' "vcan<n>" as fallback).
+// The bitrate is part of the interface configuration ("ip link set can<n> type can bitrate ...").
+bool openBusOnCard(uint8_t ui8_bus, uint32_t wBitrate, server_c* pc_serverData)
+{
+  DEBUG_PRINT1("init can bus %d\n", ui8_bus);
+
+  if (ss_canDevice.canBus(ui8_bus).mb_canBusIsOpen)
+    return true; // already initialized and socket is already open
+
+  char arrc_interface[IFNAMSIZ];
+  snprintf(arrc_interface, sizeof(arrc_interface), "can%u", unsigned(ui8_bus));
+  int i_socket = openCanSocket(arrc_interface);
+
+  if ((i_socket < 0) && pc_serverData->mb_virtualSubstitute)
+  {
+    snprintf(arrc_interface, sizeof(arrc_interface), "vcan%u", unsigned(ui8_bus));
+    i_socket = openCanSocket(arrc_interface);
+    if (i_socket >= 0)
+      ss_canDevice.canBus(ui8_bus).mb_channelVirtual = true;
+  }
+
+  if (i_socket < 0)
+  {
+    std::cerr << "Could not open SocketCAN interface for bus " << unsigned(ui8_bus) << std::endl;
+    return false;
+  }
+
+  DEBUG_PRINT2("Opened %s (requested bitrate %d kbit/s is set with ip link)\n", arrc_interface, wBitrate);
+  (void)wBitrate;
+
+  ss_canDevice.canBus(ui8_bus).mi_socket = i_socket;
+  ss_canDevice.canBus(ui8_bus).mi_rxFill = 0;
+  ss_canDevice.canBus(ui8_bus).mi_rxPos = 0;
+  ss_canDevice.canBus(ui8_bus).mb_canBusIsOpen = true;
+  pc_serverData->canBus(ui8_bus).mi32_can_device = i_socket;
+
+  return true;
+}
+
+void closeBusOnCard(uint8_t ui8_bus, server_c* pc_serverData)
+{
+  DEBUG_PRINT1("close can bus %d\n", ui8_bus);
+
+  if (!ss_canDevice.canBus(ui8_bus).mb_canBusIsOpen)
+    return;
+
+  close(ss_canDevice.canBus(ui8_bus).mi_socket);
+  ss_canDevice.canBus(ui8_bus).mi_socket = -1;
+  ss_canDevice.canBus(ui8_bus).mb_canBusIsOpen = false;
+  ss_canDevice.canBus(ui8_bus).mb_channelVirtual = false;
+  pc_serverData->canBus(ui8_bus).mi32_can_device = -1;
+}
+
+
+// PURPOSE: To send a msg on the specified CAN BUS
+// RETURNS: non-zero if msg was sent ok
+//          0 on error
+int16_t sendToBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* /* pc_serverData */)
+{
+  // should have been checked already by calling function isBusOpen:
+  assert(ss_canDevice.canBus(ui8_bus).mb_canBusIsOpen);
+
+  struct can_frame s_frame;
+  memset(&s_frame, 0, sizeof(s_frame));
+  s_frame.can_id = ps_canMsg->i32_msgType ? ((ps_canMsg->ui32_id & CAN_EFF_MASK) | CAN_EFF_FLAG) : (ps_canMsg->ui32_id & CAN_SFF_MASK);
+  s_frame.can_dlc = ps_canMsg->i32_len;
+  memcpy(s_frame.data, ps_canMsg->ui8_data, s_frame.can_dlc);
+
+  if (write(ss_canDevice.canBus(ui8_bus).mi_socket, &s_frame, sizeof(s_frame)) != sizeof(s_frame))
+  {
+    DEBUG_PRINT1("sendToBus write: %s\n", strerror(errno));
+    return 0;
+  }
+
+  return 1;
+}
+
+
+// fetch the next batch of frames with one recvmmsg() call
+static bool receiveBatch(canDevice_s::canBus_s &r_bus)
+{
+  for (int i = 0; i < SOCKETCAN_RX_BATCH; ++i)
+  {
+    // the kernel updates the lengths, so they are set up again for every call
+    r_bus.arrs_rxIov[i].iov_base = &r_bus.arrs_rxFrame[i];
+    r_bus.arrs_rxIov[i].iov_len = sizeof(struct can_frame);
+    r_bus.arrs_rxMsg[i].msg_hdr.msg_name = NULL;
+    r_bus.arrs_rxMsg[i].msg_hdr.msg_namelen = 0;
+    r_bus.arrs_rxMsg[i].msg_hdr.msg_iov = &r_bus.arrs_rxIov[i];
+    r_bus.arrs_rxMsg[i].msg_hdr.msg_iovlen = 1;
+    r_bus.arrs_rxMsg[i].msg_hdr.msg_control = r_bus.arrc_rxControl[i];
+    r_bus.arrs_rxMsg[i].msg_hdr.msg_controllen = sizeof(r_bus.arrc_rxControl[i]);
+    r_bus.arrs_rxMsg[i].msg_hdr.msg_flags = 0;
+  }
+
+  const int ci_received = recvmmsg(r_bus.mi_socket, r_bus.arrs_rxMsg, SOCKETCAN_RX_BATCH, MSG_DONTWAIT, NULL);
+  r_bus.mi_rxPos = 0;
+  r_bus.mi_rxFill = (ci_received > 0) ? ci_received : 0;
+  return (ci_received > 0);
+}
+
+// take the hardware timestamp if there is one, else the software timestamp
+// \return [usec], CAN_SERVER_RX_TIME_NONE if the driver delivers none
+static int64_t extractRxTimestamp(struct msghdr &r_msg)
+{
+  for (struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(&r_msg); p_cmsg != NULL; p_cmsg = CMSG_NXTHDR(&r_msg, p_cmsg))
+  {
+    if ((p_cmsg->cmsg_level != SOL_SOCKET) || (p_cmsg->cmsg_type != SCM_TIMESTAMPING))
+      continue;
+
+    struct scm_timestamping s_stamps;
+    memcpy(&s_stamps, CMSG_DATA(p_cmsg), sizeof(s_stamps));
+    // ts[0]: software, ts[2]: raw hardware
+    const struct timespec &r_timestamp = (s_stamps.ts[2].tv_sec || s_stamps.ts[2].tv_nsec) ? s_stamps.ts[2] : s_stamps.ts[0];
+    if (r_timestamp.tv_sec || r_timestamp.tv_nsec)
+      return int64_t(r_timestamp.tv_sec) * 1000000 + r_timestamp.tv_nsec / 1000;
+  }
+  return CAN_SERVER_RX_TIME_NONE;
+}
+
+// next frame of the current batch, a new batch is received when it's used up
+// pi64_rxTime: receive time stamp, if not NULL
+static bool nextFrame(canDevice_s::canBus_s &r_bus, canMsg_s* ps_canMsg, int64_t* pi64_rxTime)
+{
+  for (;;)
+  {
+    if ((r_bus.mi_rxPos >= r_bus.mi_rxFill) && !receiveBatch(r_bus))
+      return false;
+
+    const int ci_pos = r_bus.mi_rxPos++;
+    const struct can_frame &r_frame = r_bus.arrs_rxFrame[ci_pos];
+
+    if (r_bus.arrs_rxMsg[ci_pos].msg_len < sizeof(struct can_frame))
+      continue; // incomplete (or CAN FD) frame
+
+    if (r_frame.can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG))
+      continue; // don't process error or RTR frames
+
+    ps_canMsg->i32_msgType = (r_frame.can_id & CAN_EFF_FLAG) ? 1 : 0;
+    ps_canMsg->ui32_id = r_frame.can_id & (ps_canMsg->i32_msgType ? CAN_EFF_MASK : CAN_SFF_MASK);
+    ps_canMsg->i32_len = (r_frame.can_dlc > 8) ? 8 : r_frame.can_dlc;
+    memcpy(ps_canMsg->ui8_data, r_frame.data, ps_canMsg->i32_len);
+
+    if (pi64_rxTime)
+    {
+      const int64_t ci64_deviceTime = extractRxTimestamp(r_bus.arrs_rxMsg[ci_pos].msg_hdr);
+      *pi64_rxTime = (ci64_deviceTime == CAN_SERVER_RX_TIME_NONE)
+                   ? CAN_SERVER_RX_TIME_NONE
+                   : rxTimeToServerTime(r_bus.ms_rxClock, ci64_deviceTime);
+    }
+
+    return true;
+  }
+}
+
+bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* /* pc_serverData */)
+{
+  canDevice_s::canBus_s &r_bus = ss_canDevice.canBus(ui8_bus);
+
+  if (!r_bus.mb_canBusIsOpen)
+    return false;
+
+  return nextFrame(r_bus, ps_canMsg, NULL);
+}
+
+size_t readFromBusBatch(uint8_t ui8_bus, canMsg_s* ps_canMsgs, int64_t* pi64_rxTimes, size_t n_maxMsgs, server_c* /* pc_serverData */)
+{
+  canDevice_s::canBus_s &r_bus = ss_canDevice.canBus(ui8_bus);
+
+  if (!r_bus.mb_canBusIsOpen)
+    return 0;
+
+  size_t n_read = 0;
+  while ((n_read < n_maxMsgs) && nextFrame(r_bus, ps_canMsgs + n_read, pi64_rxTimes + n_read))
+    ++n_read;
+  return n_read;
+}
+
+int32_t getServerTimeFromClientTime( client_c& r_receiveClient, int32_t ai32_clientTime )
+{
+  return ai32_clientTime + r_receiveClient.i32_msecStartDeltaClientMinusServer;
+}
@@ -247,6 +247,39 @@ bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
   return false;
 }
 
+size_t readFromBusBatch(uint8_t ui8_bus, canMsg_s* ps_canMsgs, int64_t* pi64_rxTimes, size_t n_maxMsgs, server_c* pc_serverData)
+{
+  long            l_retval;
+  CMSG            t_CANMsg[32];
+  long      l_len;
+
+  l_len = (long)((n_maxMsgs < 32) ? n_maxMsgs : 32);
+
+  if (!ss_canDevice.canBus(ui8_bus).mb_isHandleAvailable)
+  {
+    return 0;
+  }
+
+  // canRead() fills up to l_len frames and returns their number in l_len
+  l_retval = canRead (ss_canDevice.canBus(ui8_bus).m_handle,
+                      &t_CANMsg[0],
+                      &l_len);
+  if ( l_retval != NTCAN_SUCCESS ) {
+    return 0;
+  }
+
+  for (long l_cnt = 0; l_cnt < l_len; l_cnt++) {
+    ps_canMsgs[l_cnt].ui32_id = t_CANMsg[l_cnt].l_id;
+    ps_canMsgs[l_cnt].i32_len = t_CANMsg[l_cnt].by_len & 0x0F;
+    ps_canMsgs[l_cnt].i32_msgType = (t_CANMsg[l_cnt].by_extended ? 1 : 0);
+    pi64_rxTimes[l_cnt] = CAN_SERVER_RX_TIME_NONE; // CMSG has no time stamp
+
+    for (uint8_t ui8_cnt = 0; ui8_cnt < ps_canMsgs[l_cnt].i32_len; ui8_cnt++)
+      ps_canMsgs[l_cnt].ui8_data[ui8_cnt] = t_CANMsg[l_cnt].aby_data[ui8_cnt];
+  }
+  return (size_t)l_len;
+}
+
 
 // PURPOSE: To send a msg on the specified CAN BUS
 // RETURNS: non-zero if msg was sent ok
@@ -53,6 +53,7 @@ static struct canDevice_s {
     XLaccess      m_xlPermissionMask; //!< Global permissionmask (includes all founded channels)
     XLaccess      m_xlInitMask;
     bool          mb_canBusIsOpen;
+    rxClockSync_s ms_rxClock;         //!< maps the event time stamps onto the server time
     canBus_s();
   };
   canBus_s &canBus(size_t n_index);
@@ -79,7 +80,8 @@ canDevice_s::canBus_s::canBus_s() :
   m_xlChannelMask(0),
   m_xlPermissionMask(0),
   m_xlInitMask(0),
-  mb_canBusIsOpen(false)
+  mb_canBusIsOpen(false),
+  ms_rxClock()
 {
 }
 
@@ -392,3 +394,40 @@ bool readFromBus(uint8_t ui8_bus, canMsg_s* ps_canMsg, server_c* pc_serverData)
   return true;
 }
 
+// fetch the events of up to n_maxMsgs messages with one xlReceive() call
+size_t readFromBusBatch(uint8_t ui8_bus, canMsg_s* ps_canMsgs, int64_t* pi64_rxTimes, size_t n_maxMsgs, server_c* pc_serverData)
+{
+  XLevent arrs_events[32];
+  size_t n_read = 0;
+
+  if (ui8_bus >= g_xlDrvConfig.channelCount && pc_serverData->mb_virtualSubstitute)
+    return 0;
+
+  // TX acknowledges are returned as events, too: go on until a message was received
+  while (n_read == 0)
+  {
+    unsigned int msgsrx = (unsigned int)((n_maxMsgs < 32) ? n_maxMsgs : 32);
+    const XLstatus xlStatus = xlReceive(ss_canDevice.canBus(ui8_bus).m_xlPortHandle, &msgsrx, arrs_events);
+    if ((xlStatus != XL_SUCCESS) || (msgsrx == 0))
+      break; // XL_ERR_QUEUE_IS_EMPTY
+
+    for (unsigned int i = 0; i < msgsrx; ++i)
+    {
+      const XLevent &r_event = arrs_events[i];
+      if( ( r_event.tag != XL_RECEIVE_MSG ) || ( r_event.tagData.msg.flags != 0 ) )
+        continue; // no received message
+
+      canMsg_s* ps_canMsg = ps_canMsgs + n_read;
+      ps_canMsg->ui32_id = (r_event.tagData.msg.id & 0x1FFFFFFF);
+      ps_canMsg->i32_len = r_event.tagData.msg.dlc;
+      ps_canMsg->i32_msgType = (r_event.tagData.msg.id > 0x7FFFFFFF) ? 1 : 0;
+      memcpy( ps_canMsg->ui8_data, r_event.tagData.msg.data, ps_canMsg->i32_len );
+      // time stamp of the driver [nsec]
+      pi64_rxTimes[n_read] = rxTimeToServerTime(ss_canDevice.canBus(ui8_bus).ms_rxClock, int64_t(r_event.timeStamp / 1000));
+      ++n_read;
+    }
+  }
+
+  return n_read;
+}
+